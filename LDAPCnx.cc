@@ -1,16 +1,176 @@
+#include <vector>
 #include "LDAPCnx.h"
 #include "LDAPCookie.h"
+#include "TLSContext.h"
 
 static struct timeval ldap_tv = { 0, 0 };
 
 using namespace v8;
 
+// ldap_url_parse reports a URL without a scope as LDAP_SCOPE_BASE, so
+// look for the scope in the text itself: the third ?-separated field after
+// the dn (ldap://host/dn?attrs?scope?filter?exts).
+
+static bool HasScope(const char * url) {
+  const char * p = strstr(url, "://");
+  p = p ? strchr(p + 3, '/') : NULL;
+  for (int field = 0 ; p && field < 2 ; field++) {
+    p = strchr(p + 1, '?');
+  }
+  return p && p[1] && p[1] != '?';
+}
+
+// Append each referral URL to the list as an object telling the JS side
+// where to continue the operation: { url, uri, base, scope, filter }.
+// Parts missing from the URL are left undefined so the caller can fall
+// back to the original request.
+
+static void AddReferrals(Local<Array> list, char ** refs) {
+  if (refs == NULL) {
+    return;
+  }
+  for (int i = 0 ; refs[i] ; i++) {
+    LDAPURLDesc * lud = NULL;
+    Local<Object> js_ref = Nan::New<Object>();
+
+    js_ref->Set(Nan::New("url").ToLocalChecked(), Nan::New(refs[i]).ToLocalChecked());
+    if (ldap_url_parse(refs[i], &lud) == LDAP_URL_SUCCESS) {
+      if (lud->lud_dn && *lud->lud_dn) {
+        js_ref->Set(Nan::New("base").ToLocalChecked(), Nan::New(lud->lud_dn).ToLocalChecked());
+      }
+      if (HasScope(refs[i])) {
+        js_ref->Set(Nan::New("scope").ToLocalChecked(), Nan::New(lud->lud_scope));
+      }
+      if (lud->lud_filter) {
+        js_ref->Set(Nan::New("filter").ToLocalChecked(), Nan::New(lud->lud_filter).ToLocalChecked());
+      }
+
+      // strip everything but scheme://host:port to get the server uri
+      char * dn = lud->lud_dn;
+      char ** attrs = lud->lud_attrs;
+      char * filter = lud->lud_filter;
+      char ** exts = lud->lud_exts;
+      lud->lud_dn = NULL;
+      lud->lud_attrs = NULL;
+      lud->lud_filter = NULL;
+      lud->lud_exts = NULL;
+      lud->lud_scope = LDAP_SCOPE_DEFAULT;
+      char * uri = ldap_url_desc2str(lud);
+      if (uri) {
+        js_ref->Set(Nan::New("uri").ToLocalChecked(), Nan::New(uri).ToLocalChecked());
+        ldap_memfree(uri);
+      }
+      lud->lud_dn = dn;
+      lud->lud_attrs = attrs;
+      lud->lud_filter = filter;
+      lud->lud_exts = exts;
+      ldap_free_urldesc(lud);
+    }
+    list->Set(list->Length(), js_ref);
+  }
+}
+
 Nan::Persistent<Function> LDAPCnx::constructor;
 
+// Connection setup blocks for the TCP connect and the ldaps:// handshake
+// (up to the network timeout for each server that is down) and for the
+// initial bind (up to the request timeout), so it runs on the libuv
+// threadpool. The loop thread leaves ld alone while busy is set; connect
+// callbacks fired by libldap from the worker are replayed here once it
+// completes.
+
+class ConnectWorker : public Nan::AsyncWorker {
+ public:
+  ConnectWorker(LDAPCnx * cnx, Nan::Callback * callback)
+    : Nan::AsyncWorker(callback), cnx(cnx), rc(LDAP_SUCCESS) {}
+
+  void Execute() {
+    struct berval cred = { 0, NULL };
+    struct timeval timeout = { cnx->timeout/1000, (cnx->timeout%1000) * 1000 };
+    LDAPMessage * result = NULL;
+    int msgid;
+
+    // a server that accepts the connection but never answers must not
+    // hold this thread for good
+    rc = ldap_sasl_bind(cnx->ld, NULL, LDAP_SASL_SIMPLE, &cred,
+                        NULL, NULL, &msgid);
+    if (rc != LDAP_SUCCESS) {
+      return;
+    }
+    switch (ldap_result(cnx->ld, msgid, LDAP_MSG_ALL, &timeout, &result)) {
+    case 0:
+      ldap_abandon_ext(cnx->ld, msgid, NULL, NULL);
+      rc = LDAP_TIMEOUT;
+      break;
+    case -1:
+      ldap_get_option(cnx->ld, LDAP_OPT_RESULT_CODE, &rc);
+      break;
+    default:
+      rc = ldap_result2error(cnx->ld, result, 1);
+    }
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (!cnx->Resume()) {
+      Local<Value> argv[] = { Nan::Error("Connection closed") };
+      callback->Call(1, argv);
+      return;
+    }
+    if (cnx->opened) {
+      cnx->reconnect_callback->Call(0, NULL);
+    }
+
+    Local<Value> argv[] = {
+      rc == LDAP_SUCCESS ? (Local<Value>)Nan::Undefined()
+                         : Nan::Error(ldap_err2string(rc))
+    };
+    callback->Call(1, argv);
+  }
+
+ private:
+  LDAPCnx * cnx;
+  int rc;
+};
+
+class TLSWorker : public Nan::AsyncWorker {
+ public:
+  TLSWorker(LDAPCnx * cnx, Nan::Callback * callback)
+    : Nan::AsyncWorker(callback), cnx(cnx), rc(LDAP_SUCCESS) {}
+
+  void Execute() {
+    rc = ldap_install_tls(cnx->ld);
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+
+    if (!cnx->Resume()) {
+      Local<Value> argv[] = { Nan::Error("Connection closed") };
+      callback->Call(1, argv);
+      return;
+    }
+
+    Local<Value> argv[] = {
+      rc == LDAP_SUCCESS ? (Local<Value>)Nan::Undefined()
+                         : Nan::Error(ldap_err2string(rc))
+    };
+    callback->Call(1, argv);
+  }
+
+ private:
+  LDAPCnx * cnx;
+  int rc;
+};
+
 LDAPCnx::LDAPCnx() {
 }
 
 LDAPCnx::~LDAPCnx() {
+  if (this->tls) {
+    this->tls->Release();
+  }
   free(this->ldap_callback);
   delete this->callback;
   delete this->reconnect_callback;
@@ -25,6 +185,7 @@ void LDAPCnx::Init(Local<Object> exports) {
   tpl->InstanceTemplate()->SetInternalFieldCount(1);
 
   // Prototype
+  Nan::SetPrototypeMethod(tpl, "connect", Connect);
   Nan::SetPrototypeMethod(tpl, "search", Search);
   Nan::SetPrototypeMethod(tpl, "delete", Delete);
   Nan::SetPrototypeMethod(tpl, "bind", Bind);
@@ -32,6 +193,7 @@ void LDAPCnx::Init(Local<Object> exports) {
   Nan::SetPrototypeMethod(tpl, "add", Add);
   Nan::SetPrototypeMethod(tpl, "modify", Modify);
   Nan::SetPrototypeMethod(tpl, "rename", Rename);
+  Nan::SetPrototypeMethod(tpl, "compare", Compare);
   Nan::SetPrototypeMethod(tpl, "abandon", Abandon);
   Nan::SetPrototypeMethod(tpl, "errorstring", GetErr);
   Nan::SetPrototypeMethod(tpl, "close", Close);
@@ -40,6 +202,8 @@ void LDAPCnx::Init(Local<Object> exports) {
   Nan::SetPrototypeMethod(tpl, "installtls", InstallTLS);
   Nan::SetPrototypeMethod(tpl, "starttls", StartTLS);
   Nan::SetPrototypeMethod(tpl, "checktls", CheckTLS);
+  Nan::SetPrototypeMethod(tpl, "tlsresumed", TLSResumed);
+  Nan::SetPrototypeMethod(tpl, "tlsresumable", TLSResumable);
 
   constructor.Reset(tpl->GetFunction());
   exports->Set(Nan::New("LDAPCnx").ToLocalChecked(), tpl->GetFunction());
@@ -55,13 +219,19 @@ void LDAPCnx::New(const Nan::FunctionCallbackInfo<Value>& info) {
     ld->reconnect_callback = new Nan::Callback(info[1].As<Function>());
     ld->disconnect_callback = new Nan::Callback(info[2].As<Function>());
     ld->handle = NULL;
+    ld->busy = false;
+    ld->opened = false;
+    ld->closing = false;
+    ld->tls = NULL;
+    ld->tls_ssl = NULL;
 
     Nan::Utf8String       url(info[3]);  
     int ver             = LDAP_VERSION3;
     int timeout         = info[4]->NumberValue();
     int debug           = info[5]->NumberValue();
     int verifycert      = info[6]->NumberValue();
-    int referrals       = info[7]->NumberValue();
+    int sharetls        = info[7]->NumberValue();
+    ld->timeout         = info[8]->NumberValue();
     int zero            = 0;
 
     ld->ldap_callback = (ldap_conncb *)malloc(sizeof(ldap_conncb));
@@ -81,13 +251,24 @@ void LDAPCnx::New(const Nan::FunctionCallbackInfo<Value>& info) {
     ldap_set_option(ld->ld, LDAP_OPT_CONNECT_CB,         ld->ldap_callback);
     ldap_set_option(ld->ld, LDAP_OPT_NETWORK_TIMEOUT,    &ntimeout);
     ldap_set_option(ld->ld, LDAP_OPT_X_TLS_REQUIRE_CERT, &verifycert);
-    ldap_set_option(ld->ld, LDAP_OPT_X_TLS_NEWCTX,       &zero);
 
-    ldap_set_option(ld->ld, LDAP_OPT_REFERRALS,          &referrals);
-    if (referrals) {
-      ldap_set_rebind_proc(ld->ld, OnRebind, ld);
+    if (sharetls) {
+      ld->tls = TLSContext::Acquire(verifycert);
     }
-    
+    if (ld->tls) {
+      ldap_set_option(ld->ld, LDAP_OPT_X_TLS_CTX,        ld->tls->Context());
+#ifdef LDAP_OPT_X_TLS_CONNECT_CB
+      ldap_set_option(ld->ld, LDAP_OPT_X_TLS_CONNECT_CB, (void *)OnTLSConnect);
+      ldap_set_option(ld->ld, LDAP_OPT_X_TLS_CONNECT_ARG, ld);
+#endif
+    } else {
+      ldap_set_option(ld->ld, LDAP_OPT_X_TLS_NEWCTX,     &zero);
+    }
+
+    // Referrals are chased from JS on connections we control, never
+    // synchronously inside libldap.
+    ldap_set_option(ld->ld, LDAP_OPT_REFERRALS,          LDAP_OPT_OFF);
+
     info.GetReturnValue().Set(info.Holder());
     return;
   }
@@ -119,59 +300,55 @@ void LDAPCnx::Event(uv_poll_t* handle, int status, int events) {
       }
       switch ( msgtype = ldap_msgtype( message ) ) {
       case LDAP_RES_SEARCH_REFERENCE:
-        break;
       case LDAP_RES_SEARCH_ENTRY:
       case LDAP_RES_SEARCH_RESULT:
         {
-          Local<Array> js_result_list = Nan::New<Array>(ldap_count_entries(ld->ld, message));
-
-          int j;
-  
-          for (entry = ldap_first_entry(ld->ld, message), j = 0 ; entry ;
-               entry = ldap_next_entry(ld->ld, entry), j++) {
-            Local<Object> js_result = Nan::New<Object>();
-
-            js_result_list->Set(Nan::New(j), js_result);
-    
-            char * dn = ldap_get_dn(ld->ld, entry);
-            BerElement * berptr = NULL;
-            for (char * attrname = ldap_first_attribute(ld->ld, entry, &berptr) ;
-                 attrname ; attrname = ldap_next_attribute(ld->ld, entry, berptr)) {
-              berval ** vals = ldap_get_values_len(ld->ld, entry, attrname);
-              int num_vals = ldap_count_values_len(vals);
-              Local<Array> js_attr_vals = Nan::New<Array>(num_vals);
-              js_result->Set(Nan::New(attrname).ToLocalChecked(), js_attr_vals);
-
-              // TODO: check for binary settings
-              int bin = isBinary(attrname);
-              
-              for (int i = 0 ; i < num_vals && vals[i] ; i++) {
-                if (bin) {
-                  js_attr_vals->Set(Nan::New(i), Nan::CopyBuffer(vals[i]->bv_val, vals[i]->bv_len).ToLocalChecked());
-                } else {
-                  js_attr_vals->Set(Nan::New(i), Nan::New(vals[i]->bv_val).ToLocalChecked());
-                }
-              } // all values for this attr added.
-              ldap_value_free_len(vals);
-              ldap_memfree(attrname);
-            } // attrs for this entry added. Next entry.
-            js_result->Set(Nan::New("dn").ToLocalChecked(), Nan::New(dn).ToLocalChecked());
-            ber_free(berptr,0);
-            ldap_memfree(dn);
-          } // all entries done.
+          Local<Value> js_result_list;
+          std::map<int, int>::iterator format = ld->formats.find(ldap_msgid(message));
+
+          if (format == ld->formats.end()) {
+            js_result_list = ld->EntriesAsObjects(message);
+          } else {
+            if (format->second == RESULT_PACKED) {
+              js_result_list = ld->EntriesPacked(message);
+            } else {
+              js_result_list = ld->EntriesAsColumns(message);
+            }
+            ld->formats.erase(format);
+          }
 
           Local<Object> result_container = Nan::New<Object>();
           result_container->Set(Nan::New("data").ToLocalChecked(), js_result_list);
 
-          LDAPControl** serverCtrls;
+          // continuation references returned alongside the entries
+          Local<Array> js_referrals = Nan::New<Array>();
+          for (entry = ldap_first_reference(ld->ld, message) ; entry ;
+               entry = ldap_next_reference(ld->ld, entry)) {
+            char ** refs = NULL;
+            if (ldap_parse_reference(ld->ld, entry, &refs, NULL, 0) == LDAP_SUCCESS) {
+              AddReferrals(js_referrals, refs);
+              ldap_memvfree((void **)refs);
+            }
+          }
+
+          LDAPControl** serverCtrls = NULL;
+          char ** referrals = NULL;
           ldap_parse_result(ld->ld, message,
               NULL, // int* errcodep
               NULL, // char** matcheddnp
               NULL, // char** errmsp
-              NULL, // char*** referralsp
+              &referrals,
               &serverCtrls,
               0     // freeit
               );
+          if (referrals) {
+            // the whole search was referred elsewhere (LDAP_REFERRAL)
+            AddReferrals(js_referrals, referrals);
+            ldap_memvfree((void **)referrals);
+          }
+          if (js_referrals->Length()) {
+            result_container->Set(Nan::New("referrals").ToLocalChecked(), js_referrals);
+          }
           if (serverCtrls) {
             struct berval* cookie = NULL;
             ldap_parse_page_control(ld->ld, serverCtrls, NULL, &cookie);
@@ -217,6 +394,23 @@ void LDAPCnx::Event(uv_poll_t* handle, int status, int events) {
 
           break;
         }
+      case LDAP_RES_COMPARE:
+        {
+          // "compare true" and "compare false" are answers, not errors
+          Local<Value> result = Nan::Undefined();
+          if (err == LDAP_COMPARE_TRUE || err == LDAP_COMPARE_FALSE) {
+            errparam = Nan::Undefined();
+            result = Nan::New<Boolean>(err == LDAP_COMPARE_TRUE);
+          }
+
+          Local<Value> argv[] = {
+            errparam,
+            Nan::New(ldap_msgid(message)),
+            result
+          };
+          ld->callback->Call(3, argv);
+          break;
+        }
       case LDAP_RES_MODIFY:
       case LDAP_RES_MODDN:
       case LDAP_RES_ADD:
@@ -242,22 +436,225 @@ void LDAPCnx::Event(uv_poll_t* handle, int status, int events) {
   return;
 }
 
+Local<Array> LDAPCnx::AttrValues(char * attrname, berval ** vals) {
+  int num_vals = ldap_count_values_len(vals);
+  Local<Array> js_attr_vals = Nan::New<Array>(num_vals);
+
+  // TODO: check for binary settings
+  int bin = isBinary(attrname);
+
+  for (int i = 0 ; i < num_vals && vals[i] ; i++) {
+    if (bin) {
+      js_attr_vals->Set(Nan::New(i), Nan::CopyBuffer(vals[i]->bv_val, vals[i]->bv_len).ToLocalChecked());
+    } else {
+      js_attr_vals->Set(Nan::New(i), Nan::New(vals[i]->bv_val).ToLocalChecked());
+    }
+  } // all values for this attr added.
+  return js_attr_vals;
+}
+
+// The default layout: an array of { attr: [ values ], dn: dn } objects.
+
+Local<Value> LDAPCnx::EntriesAsObjects(LDAPMessage * message) {
+  Local<Array> js_result_list = Nan::New<Array>(ldap_count_entries(ld, message));
+  LDAPMessage * entry;
+  int j;
+
+  for (entry = ldap_first_entry(ld, message), j = 0 ; entry ;
+       entry = ldap_next_entry(ld, entry), j++) {
+    Local<Object> js_result = Nan::New<Object>();
+
+    js_result_list->Set(Nan::New(j), js_result);
+
+    char * dn = ldap_get_dn(ld, entry);
+    BerElement * berptr = NULL;
+    for (char * attrname = ldap_first_attribute(ld, entry, &berptr) ;
+         attrname ; attrname = ldap_next_attribute(ld, entry, berptr)) {
+      berval ** vals = ldap_get_values_len(ld, entry, attrname);
+      js_result->Set(Nan::New(attrname).ToLocalChecked(), AttrValues(attrname, vals));
+      ldap_value_free_len(vals);
+      ldap_memfree(attrname);
+    } // attrs for this entry added. Next entry.
+    js_result->Set(Nan::New("dn").ToLocalChecked(), Nan::New(dn).ToLocalChecked());
+    ber_free(berptr,0);
+    ldap_memfree(dn);
+  } // all entries done.
+
+  return js_result_list;
+}
+
+// Columnar layout: { dn: [ dn, ... ], attr: [ [ values ], ... ], ... },
+// every column indexed by entry. Entries lacking an attribute leave a
+// hole in its column.
+
+Local<Value> LDAPCnx::EntriesAsColumns(LDAPMessage * message) {
+  int count = ldap_count_entries(ld, message);
+  Local<Object> js_columns = Nan::New<Object>();
+  Local<Array> js_dns = Nan::New<Array>(count);
+  std::map<std::string, Local<Array> > columns;
+  LDAPMessage * entry;
+  int j;
+
+  js_columns->Set(Nan::New("dn").ToLocalChecked(), js_dns);
+
+  for (entry = ldap_first_entry(ld, message), j = 0 ; entry ;
+       entry = ldap_next_entry(ld, entry), j++) {
+    char * dn = ldap_get_dn(ld, entry);
+    js_dns->Set(Nan::New(j), Nan::New(dn).ToLocalChecked());
+    ldap_memfree(dn);
+
+    BerElement * berptr = NULL;
+    for (char * attrname = ldap_first_attribute(ld, entry, &berptr) ;
+         attrname ; attrname = ldap_next_attribute(ld, entry, berptr)) {
+      std::map<std::string, Local<Array> >::iterator column = columns.find(attrname);
+      if (column == columns.end()) {
+        Local<Array> js_column = Nan::New<Array>(count);
+        js_columns->Set(Nan::New(attrname).ToLocalChecked(), js_column);
+        column = columns.insert(std::make_pair(std::string(attrname), js_column)).first;
+      }
+      berval ** vals = ldap_get_values_len(ld, entry, attrname);
+      column->second->Set(Nan::New(j), AttrValues(attrname, vals));
+      ldap_value_free_len(vals);
+      ldap_memfree(attrname);
+    }
+    ber_free(berptr,0);
+  }
+
+  return js_columns;
+}
+
+// Packed layout: every value (dn first, then each attribute in the order
+// of attrs) copied back to back into one Buffer.
+//
+//   attrs:   [ 'dn', name, ... ]
+//   count:   number of entries
+//   index:   uint32[count * attrs.length + 1]; the values of attribute a
+//            of entry e are numbers index[e*A+a] up to index[e*A+a+1]
+//   offsets: uint32[values + 1]; value v is buffer[offsets[v]..offsets[v+1]]
+//   buffer:  the value bytes
+//
+// index and offsets are returned as Buffers for JS to view as Uint32Arrays.
+
+Local<Value> LDAPCnx::EntriesPacked(LDAPMessage * message) {
+  struct Attr {
+    size_t entry;
+    size_t column;
+    berval ** vals;
+  };
+  std::vector<Attr> attrs;
+  std::vector<char *> dns;
+  std::vector<std::string> names;
+  std::map<std::string, size_t> columns;
+  size_t bytes = 0;
+  size_t values = 0;
+  LDAPMessage * entry;
+
+  names.push_back("dn");
+
+  // first pass: sizes, and the column for every attribute seen
+  for (entry = ldap_first_entry(ld, message) ; entry ;
+       entry = ldap_next_entry(ld, entry)) {
+    char * dn = ldap_get_dn(ld, entry);
+    bytes += strlen(dn);
+    values++;
+
+    BerElement * berptr = NULL;
+    for (char * attrname = ldap_first_attribute(ld, entry, &berptr) ;
+         attrname ; attrname = ldap_next_attribute(ld, entry, berptr)) {
+      std::map<std::string, size_t>::iterator column = columns.find(attrname);
+      if (column == columns.end()) {
+        column = columns.insert(std::make_pair(std::string(attrname), names.size())).first;
+        names.push_back(attrname);
+      }
+      Attr attr = { dns.size(), column->second,
+                    ldap_get_values_len(ld, entry, attrname) };
+      for (int i = 0 ; attr.vals && attr.vals[i] ; i++) {
+        bytes += attr.vals[i]->bv_len;
+        values++;
+      }
+      attrs.push_back(attr);
+      ldap_memfree(attrname);
+    }
+    ber_free(berptr,0);
+    dns.push_back(dn);
+  }
+
+  size_t count = dns.size();
+  size_t width = names.size();
+  std::vector<berval **> grid(count * width, (berval **)NULL);
+  for (size_t i = 0 ; i < attrs.size() ; i++) {
+    grid[attrs[i].entry * width + attrs[i].column] = attrs[i].vals;
+  }
+
+  // second pass: copy everything into place
+  std::vector<uint32_t> index(count * width + 1);
+  std::vector<uint32_t> offsets;
+  char * buffer = (char *)malloc(bytes ? bytes : 1);
+  size_t pos = 0;
+
+  offsets.reserve(values + 1);
+  for (size_t e = 0 ; e < count ; e++) {
+    size_t len = strlen(dns[e]);
+    index[e * width] = offsets.size();
+    offsets.push_back(pos);
+    memcpy(buffer + pos, dns[e], len);
+    pos += len;
+    ldap_memfree(dns[e]);
+
+    for (size_t c = 1 ; c < width ; c++) {
+      berval ** vals = grid[e * width + c];
+      index[e * width + c] = offsets.size();
+      for (int i = 0 ; vals && vals[i] ; i++) {
+        offsets.push_back(pos);
+        memcpy(buffer + pos, vals[i]->bv_val, vals[i]->bv_len);
+        pos += vals[i]->bv_len;
+      }
+    }
+  }
+  index[count * width] = offsets.size();
+  offsets.push_back(pos);
+
+  for (size_t i = 0 ; i < attrs.size() ; i++) {
+    ldap_value_free_len(attrs[i].vals);
+  }
+
+  Local<Array> js_names = Nan::New<Array>(width);
+  for (size_t c = 0 ; c < width ; c++) {
+    js_names->Set(Nan::New((uint32_t)c), Nan::New(names[c]).ToLocalChecked());
+  }
+
+  Local<Object> js_packed = Nan::New<Object>();
+  js_packed->Set(Nan::New("attrs").ToLocalChecked(), js_names);
+  js_packed->Set(Nan::New("count").ToLocalChecked(), Nan::New((uint32_t)count));
+  js_packed->Set(Nan::New("index").ToLocalChecked(),
+                 Nan::CopyBuffer((char *)&index[0], index.size() * sizeof(uint32_t)).ToLocalChecked());
+  js_packed->Set(Nan::New("offsets").ToLocalChecked(),
+                 Nan::CopyBuffer((char *)&offsets[0], offsets.size() * sizeof(uint32_t)).ToLocalChecked());
+  // the Buffer takes ownership of our allocation, no copy
+  js_packed->Set(Nan::New("buffer").ToLocalChecked(),
+                 Nan::NewBuffer(buffer, pos).ToLocalChecked());
+  return js_packed;
+}
+
 int LDAPCnx::OnConnect(LDAP *ld, Sockbuf *sb,
                       LDAPURLDesc *srv, struct sockaddr *addr,
                       struct ldap_conncb *ctx) {
-  int fd;
   LDAPCnx * lc = (LDAPCnx *)ctx->lc_arg;
-  
-  if (lc->handle == NULL) {
-    lc->handle = new uv_poll_t;
-    ldap_get_option(ld, LDAP_OPT_DESC, &fd);
-    uv_poll_init(uv_default_loop(), lc->handle, fd);
-    lc->handle->data = lc;
-  } else {
-    uv_poll_stop(lc->handle);
+
+  if (lc->tls) {
+    // remembered for TLS session resumption; the handshake follows
+    char port[16];
+    snprintf(port, sizeof(port), ":%d", srv->lud_port);
+    lc->tls_peer = std::string(srv->lud_host ? srv->lud_host : "") + port;
+  }
+
+  if (lc->busy) {
+    // we're on a threadpool thread; the worker picks this up on completion
+    lc->opened = true;
+    return LDAP_SUCCESS;
   }
-  uv_poll_start(lc->handle, UV_READABLE, (uv_poll_cb)lc->Event);
 
+  lc->Poll();
   lc->reconnect_callback->Call(0, NULL);
 
   return LDAP_SUCCESS;
@@ -267,23 +664,105 @@ void LDAPCnx::OnDisconnect(LDAP *ld, Sockbuf *sb,
                       struct ldap_conncb *ctx) {
   // this fires when the connection closes
   LDAPCnx * lc = (LDAPCnx *)ctx->lc_arg;
+  if (lc->tls_ssl) {
+    TLSContext::Forget(lc->tls_ssl);
+    lc->tls_ssl = NULL;
+  }
+  if (lc->busy) {
+    // a failed connect attempt on the threadpool; nothing was polling yet
+    return;
+  }
   if (lc->handle) {
     uv_poll_stop(lc->handle);
   }
   lc->disconnect_callback->Call(0, NULL);
 }
 
-int LDAPCnx::OnRebind(LDAP *ld, LDAP_CONST char *url, ber_tag_t request,
-                       ber_int_t msgid, void *params) {
-  // this is a new *ld representing the new server connection
-  // so our existing code won't work!
-  
-  return LDAP_SUCCESS;
+int LDAPCnx::OnTLSConnect(LDAP *ld, void *ssl, void *ctx, void *arg) {
+  LDAPCnx * lc = (LDAPCnx *)arg;
+
+  lc->tls_ssl = ssl;
+  lc->tls->Resume(ssl, lc->tls_peer);
+  return 0;
+}
+
+void LDAPCnx::Poll() {
+  int fd = -1;
+
+  ldap_get_option(ld, LDAP_OPT_DESC, &fd);
+  if (fd < 0) {
+    return;
+  }
+  if (handle == NULL) {
+    handle = new uv_poll_t;
+    uv_poll_init(uv_default_loop(), handle, fd);
+    handle->data = this;
+  } else {
+    uv_poll_stop(handle);
+  }
+  uv_poll_start(handle, UV_READABLE, (uv_poll_cb)Event);
+}
+
+// Hand ld over to a threadpool worker.
+
+void LDAPCnx::Suspend() {
+  if (handle) {
+    uv_poll_stop(handle);
+  }
+  busy = true;
+  opened = false;
+}
+
+// Take ld back from a worker. Returns false if the connection was closed
+// while the worker ran, in which case nothing more should be done with it.
+
+bool LDAPCnx::Resume() {
+  busy = false;
+  if (closing) {
+    ldap_unbind(ld);
+    return false;
+  }
+  for (size_t i = 0 ; i < abandoned.size() ; i++) {
+    ldap_abandon(ld, abandoned[i]);
+  }
+  abandoned.clear();
+  Poll();
+  return true;
+}
+
+// For methods called while a worker owns ld: sets result as the return
+// value and returns true if the caller must not go on to use ld.
+
+bool LDAPCnx::Busy(const Nan::FunctionCallbackInfo<Value>& info, int result) {
+  if (busy) {
+    info.GetReturnValue().Set(result);
+  }
+  return busy;
+}
+
+void LDAPCnx::Connect(const Nan::FunctionCallbackInfo<Value>& info) {
+  LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->busy) {
+    Nan::ThrowError("Connection setup already in progress");
+    return;
+  }
+  ld->Suspend();
+
+  ConnectWorker * worker = new ConnectWorker(ld,
+                                   new Nan::Callback(info[0].As<Function>()));
+  worker->SaveToPersistent("cnx", info.Holder());
+  Nan::AsyncQueueWorker(worker);
 }
 
 void LDAPCnx::GetErr(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
   int err;
+
+  if (ld->busy) {
+    info.GetReturnValue().Set(Nan::New("Connection setup in progress").ToLocalChecked());
+    return;
+  }
   ldap_get_option(ld->ld, LDAP_OPT_RESULT_CODE, &err);
   info.GetReturnValue().Set(Nan::New(ldap_err2string(err)).ToLocalChecked());
 }
@@ -291,11 +770,21 @@ void LDAPCnx::GetErr(const Nan::FunctionCallbackInfo<Value>& info) {
 void LDAPCnx::Close(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
 
+  if (ld->busy) {
+    // the worker unbinds when it hands ld back
+    ld->closing = true;
+    info.GetReturnValue().Set(LDAP_SUCCESS);
+    return;
+  }
   info.GetReturnValue().Set(ldap_unbind(ld->ld));
 }
 
 void LDAPCnx::StartTLS(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
   int msgid;
   int res;
   
@@ -307,23 +796,76 @@ void LDAPCnx::StartTLS(const Nan::FunctionCallbackInfo<Value>& info) {
 void LDAPCnx::InstallTLS(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
 
-  info.GetReturnValue().Set(ldap_install_tls(ld->ld)); 
+  if (!info[0]->IsFunction()) {
+    // blocking handshake, for compatibility
+    if (ld->Busy(info, LDAP_CONNECT_ERROR)) {
+      return;
+    }
+    info.GetReturnValue().Set(ldap_install_tls(ld->ld));
+    return;
+  }
+  if (ld->busy) {
+    Nan::ThrowError("Connection setup already in progress");
+    return;
+  }
+  ld->Suspend();
+
+  TLSWorker * worker = new TLSWorker(ld,
+                               new Nan::Callback(info[0].As<Function>()));
+  worker->SaveToPersistent("cnx", info.Holder());
+  Nan::AsyncQueueWorker(worker);
 }
 
 void LDAPCnx::CheckTLS(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
 
+  if (ld->Busy(info, 0)) {
+    return;
+  }
+
   info.GetReturnValue().Set(ldap_tls_inplace(ld->ld));
 }
 
+// Only known for connections sharing a TLSContext.
+
+void LDAPCnx::TLSResumed(const Nan::FunctionCallbackInfo<Value>& info) {
+  LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, 0)) {
+    return;
+  }
+
+  info.GetReturnValue().Set(ld->tls != NULL && TLSContext::Resumed(ld->tls_ssl));
+}
+
+// Whether this connection shares a TLSContext that can resume sessions.
+// Known once the context has been created, which it is in New.
+
+void LDAPCnx::TLSResumable(const Nan::FunctionCallbackInfo<Value>& info) {
+  LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  info.GetReturnValue().Set(ld->tls != NULL && TLSContext::Resumable());
+}
+
 void LDAPCnx::Abandon(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+  int msgid = info[0]->NumberValue();
 
-  info.GetReturnValue().Set(ldap_abandon(ld->ld, info[0]->NumberValue()));
+  ld->formats.erase(msgid);
+  if (ld->busy) {
+    ld->abandoned.push_back(msgid);
+    info.GetReturnValue().Set(LDAP_SUCCESS);
+    return;
+  }
+  info.GetReturnValue().Set(ldap_abandon(ld->ld, msgid));
 }
 
 void LDAPCnx::GetErrNo(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, LDAP_CONNECT_ERROR)) {
+    return;
+  }
   int err;
   ldap_get_option(ld->ld, LDAP_OPT_RESULT_CODE, &err);
   info.GetReturnValue().Set(err);
@@ -331,13 +873,21 @@ void LDAPCnx::GetErrNo(const Nan::FunctionCallbackInfo<Value>& info) {
 
 void LDAPCnx::GetFD(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
-  int fd;
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
+  int fd = -1;
   ldap_get_option(ld->ld, LDAP_OPT_DESC, &fd);
   info.GetReturnValue().Set(fd);
 }
 
 void LDAPCnx::Delete(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
   Nan::Utf8String dn(info[0]);
 
   info.GetReturnValue().Set(ldap_delete(ld->ld, *dn));
@@ -345,6 +895,10 @@ void LDAPCnx::Delete(const Nan::FunctionCallbackInfo<Value>& info) {
 
 void LDAPCnx::Bind(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
   Nan::Utf8String dn(info[0]);
   Nan::Utf8String pw(info[1]);
 
@@ -355,6 +909,10 @@ void LDAPCnx::Bind(const Nan::FunctionCallbackInfo<Value>& info) {
 
 void LDAPCnx::Rename(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
   Nan::Utf8String dn(info[0]);
   Nan::Utf8String newrdn(info[1]);
   int res;
@@ -364,13 +922,45 @@ void LDAPCnx::Rename(const Nan::FunctionCallbackInfo<Value>& info) {
   info.GetReturnValue().Set(res);
 }
 
+void LDAPCnx::Compare(const Nan::FunctionCallbackInfo<Value>& info) {
+  LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
+  Nan::Utf8String dn(info[0]);
+  Nan::Utf8String attr(info[1]);
+  Nan::Utf8String value(info[2]);
+  struct berval bv;
+  int msgid;
+
+  if (node::Buffer::HasInstance(info[2])) {
+    bv.bv_val = node::Buffer::Data(info[2]);
+    bv.bv_len = node::Buffer::Length(info[2]);
+  } else {
+    bv.bv_val = *value;
+    bv.bv_len = value.length();
+  }
+
+  if (ldap_compare_ext(ld->ld, *dn, *attr, &bv, NULL, NULL, &msgid) != LDAP_SUCCESS) {
+    msgid = -1;
+  }
+
+  info.GetReturnValue().Set(msgid);
+}
+
 void LDAPCnx::Search(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
   Nan::Utf8String base(info[0]);
   Nan::Utf8String filter(info[1]);
   Nan::Utf8String attrs(info[2]);
   int scope = info[3]->NumberValue();
   int pagesize = info[4]->NumberValue();;
+  int format = info[6]->NumberValue();
   LDAPCookie* cookie = NULL;
   
   int msgid = 0;
@@ -404,12 +994,20 @@ void LDAPCnx::Search(const Nan::FunctionCallbackInfo<Value>& info) {
   }
 
   free(bufhead);
-  
+
+  if (msgid > 0 && format != RESULT_OBJECTS) {
+    ld->formats[msgid] = format;
+  }
+
   info.GetReturnValue().Set(msgid);
 }
 
 void LDAPCnx::Modify(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
   Nan::Utf8String dn(info[0]);
   
   Handle<Array> mods = Handle<Array>::Cast(info[1]);
@@ -459,6 +1057,10 @@ void LDAPCnx::Modify(const Nan::FunctionCallbackInfo<Value>& info) {
 
 void LDAPCnx::Add(const Nan::FunctionCallbackInfo<Value>& info) {
   LDAPCnx* ld = ObjectWrap::Unwrap<LDAPCnx>(info.Holder());
+
+  if (ld->Busy(info, -1)) {
+    return;
+  }
   Nan::Utf8String dn(info[0]);
   Handle<Array> attrs = Handle<Array>::Cast(info[1]);
   unsigned int numattrs = attrs->Length();
@@ -3,8 +3,16 @@
 
 #include <nan.h>
 #include <ldap.h>
+#include <map>
+#include <string>
+#include <vector>
+
+class TLSContext;
 
 class LDAPCnx : public Nan::ObjectWrap {
+  friend class ConnectWorker;
+  friend class TLSWorker;
+
  public:
   static void Init(v8::Local<v8::Object> exports);
   Nan::Callback * callback;
@@ -20,8 +28,8 @@ class LDAPCnx : public Nan::ObjectWrap {
   static int  OnConnect   (LDAP *ld, Sockbuf *sb, LDAPURLDesc *srv,
                            struct sockaddr *addr, struct ldap_conncb *ctx);
   static void OnDisconnect(LDAP *ld, Sockbuf *sb, struct ldap_conncb *ctx);
-  static int  OnRebind    (LDAP *ld, LDAP_CONST char *url, ber_tag_t request,
-                           ber_int_t msgid, void *params );
+  static int  OnTLSConnect(LDAP *ld, void *ssl, void *ctx, void *arg);
+  static void Connect     (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Search      (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Delete      (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Bind        (const Nan::FunctionCallbackInfo<v8::Value>& info);
@@ -29,6 +37,7 @@ class LDAPCnx : public Nan::ObjectWrap {
   static void Add         (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Modify      (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Rename      (const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void Compare     (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Abandon     (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void GetErr      (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void Close       (const Nan::FunctionCallbackInfo<v8::Value>& info);
@@ -37,13 +46,41 @@ class LDAPCnx : public Nan::ObjectWrap {
   static void StartTLS    (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void InstallTLS  (const Nan::FunctionCallbackInfo<v8::Value>& info);
   static void CheckTLS    (const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void TLSResumed  (const Nan::FunctionCallbackInfo<v8::Value>& info);
+  static void TLSResumable(const Nan::FunctionCallbackInfo<v8::Value>& info);
   static int isBinary     (char * attrname);
+  static v8::Local<v8::Array> AttrValues(char * attrname, berval ** vals);
+
+  // search result layouts, selected per search
+  enum { RESULT_OBJECTS, RESULT_COLUMNS, RESULT_PACKED };
+  v8::Local<v8::Value> EntriesAsObjects(LDAPMessage * message);
+  v8::Local<v8::Value> EntriesAsColumns(LDAPMessage * message);
+  v8::Local<v8::Value> EntriesPacked   (LDAPMessage * message);
+  std::map<int, int> formats;   // msgid -> layout, if not RESULT_OBJECTS
+
+  void Poll();
+  void Suspend();
+  bool Resume();
+  bool Busy(const Nan::FunctionCallbackInfo<v8::Value>& info, int result);
 
   int SASLBindNext(LDAPMessage** result);
   const char* sasl_mechanism;
 
   ldap_conncb * ldap_callback;
   uv_poll_t * handle;
+
+  // Set while a threadpool worker owns ld (connect, TLS handshake).
+  // Nothing else may touch ld until the worker completes: requests fail
+  // with -1, and abandons and close are deferred until then.
+  bool busy;
+  bool opened;
+  bool closing;
+  std::vector<int> abandoned;
+  int timeout;            // ms to wait for the connect-time bind
+
+  TLSContext * tls;       // shared context, if this connection opted in
+  std::string tls_peer;   // host:port of the server being connected to
+  void * tls_ssl;
   
   static Nan::Persistent<v8::Function> constructor;
   LDAP * ld;
@@ -0,0 +1,335 @@
+/*jshint globalstrict:true, node:true, trailing:true, unused:true */
+
+'use strict';
+
+var LDAPError = require('./LDAPError');
+
+var LATENCY_WEIGHT = 0.2;   // EWMA smoothing for latency and error rate
+var SAMPLES        = 64;    // latencies kept per replica for the p95
+var ERROR_PENALTY  = 10;    // how hard the error rate weighs on the score
+
+function copy(target, other) {
+    Object.keys(other).forEach(function(key) {
+        target[key] = other[key];
+    });
+    return target;
+}
+
+// Errors that say something about the server rather than the request.
+function unhealthy(err) {
+    return err !== undefined && err !== null &&
+        (err.message === 'Timeout' ||
+         err.message === 'Can\'t contact LDAP server' ||
+         err.message === 'Server is unavailable' ||
+         err.message === 'Server is busy');
+}
+
+function Replica(uri) {
+    this.uri       = uri;
+    this.ldap      = undefined;
+    this.up        = false;
+    this.unbound   = false;   // the last bind failed here
+    this.latency   = 0;
+    this.errorrate = 0;
+    this.samples   = [];
+    this.requests  = 0;
+    this.errors    = 0;
+    this.hedges    = 0;
+    return this;
+}
+
+Replica.prototype.record = function(started, err) {
+    var elapsed = Date.now() - started;
+    var failed = unhealthy(err) ? 1 : 0;
+
+    this.requests++;
+    this.errors += failed;
+    this.latency = this.samples.length ?
+        this.latency + LATENCY_WEIGHT * (elapsed - this.latency) : elapsed;
+    this.errorrate += LATENCY_WEIGHT * (failed - this.errorrate);
+
+    this.samples.push(elapsed);
+    if (this.samples.length > SAMPLES) {
+        this.samples.shift();
+    }
+};
+
+Replica.prototype.score = function() {
+    return this.latency * (1 + ERROR_PENALTY * this.errorrate);
+};
+
+Replica.prototype.p95 = function() {
+    if (this.samples.length === 0) {
+        return undefined;
+    }
+    var sorted = this.samples.slice().sort(function(a, b) { return a - b; });
+    return sorted[Math.floor((sorted.length - 1) * 0.95)];
+};
+
+// A set of connections to equivalent servers (one per uri). Reads go to
+// the replica with the best latency / error score, writes go to the first
+// replica in uri order that is up, and binds are applied to all of them.
+function ReplicaSet(opt, fn) {
+    var LDAP = require('./index');
+    var uris = typeof opt.uri === 'string' ? [ opt.uri ] : opt.uri;
+    var pending = uris.length;
+    var firsterr;
+
+    if (typeof fn !== 'function') {
+        fn = function() {};
+    }
+
+    this.options = copy({
+        hedge:      false,
+        hedgedelay: 5,
+        connect:    function() {},
+        disconnect: function() {}
+    }, opt);
+
+    this.replicas = uris.map(function(uri) {
+        var replica = new Replica(uri);
+        var options = this.options;
+        replica.ldap = new LDAP(copy(copy({}, options), {
+            uri: uri,
+            connect: function replicaConnect() {
+                replica.up = true;
+                return options.connect.call(this);
+            },
+            disconnect: function replicaDisconnect() {
+                replica.up = false;
+                return options.disconnect.call(this);
+            }
+        }), function replicaReady(err) {
+            replica.up = !err;
+            if (err) {
+                firsterr = firsterr || err;
+            }
+            if (fn !== undefined && (!err || --pending === 0)) {
+                var ready = fn;
+                fn = undefined;
+                ready.call(this, err ? firsterr : undefined);
+            }
+        }.bind(this));
+        return replica;
+    }, this);
+
+    return this;
+}
+
+// Replicas requests may go to: connected ones where the last bind took.
+// A replica whose bind failed would run requests under the wrong
+// identity, so it is left out until a bind succeeds there again.
+ReplicaSet.prototype.live = function() {
+    var bound = this.replicas.filter(function(replica) {
+        return !replica.unbound;
+    });
+    if (bound.length === 0) {
+        // the bind failed everywhere, and said so
+        bound = this.replicas;
+    }
+    var up = bound.filter(function(replica) {
+        return replica.up;
+    });
+    return up.length ? up : bound;
+};
+
+// Replicas in the order reads should be tried.
+ReplicaSet.prototype.ranked = function() {
+    return this.live().slice().sort(function(a, b) {
+        return a.score() - b.score();
+    });
+};
+
+ReplicaSet.prototype.primary = function() {
+    return this.live()[0];
+};
+
+// Run a read on the best replica. If hedging is on and the answer has not
+// arrived by that replica's p95 latency, send the same read to the next
+// best one; whichever answers first wins and the other is cancelled. The
+// loser is charged the time it had taken so far, so a replica that keeps
+// losing stops ranking first.
+ReplicaSet.prototype.read = function(send, fn) {
+    var ranked = this.ranked();
+    var attempts = [];
+    var finished = false;
+    var hedge;
+
+    function attempt(replica) {
+        var entry = { replica: replica, started: Date.now(), request: undefined };
+        attempts.push(entry);
+        send(replica, function readResult(err) {
+            replica.record(entry.started, err);
+            entry.request = undefined;
+            if (finished) {
+                return;
+            }
+            finished = true;
+            clearTimeout(hedge);
+            attempts.forEach(function(other) {
+                if (other !== entry && other.request !== undefined) {
+                    other.request.cancel();
+                    other.request = undefined;
+                    other.replica.record(other.started);
+                }
+            });
+            fn.apply(this, arguments);
+        });
+        if (!finished) {
+            // held or sent, enqueue's handle cancels it
+            entry.request = replica.ldap.lastrequest;
+        }
+    }
+
+    attempt(ranked[0]);
+
+    if (this.options.hedge && ranked.length > 1 && !finished) {
+        var delay = ranked[0].p95();
+        hedge = setTimeout(function sendHedge() {
+            ranked[1].hedges++;
+            attempt(ranked[1]);
+        }, Math.max(delay === undefined ? 0 : delay, this.options.hedgedelay));
+    }
+    return this;
+};
+
+ReplicaSet.prototype.write = function(send, fn) {
+    var replica = this.primary();
+    var started = Date.now();
+    send(replica, function writeResult(err) {
+        replica.record(started, err);
+        fn.apply(this, arguments);
+    });
+    return this;
+};
+
+ReplicaSet.prototype.search = function(opt, fn) {
+    var pinned = opt.cookie && opt.cookie.replica;
+
+    function send(replica, done) {
+        replica.ldap.search(opt, function(err, data, cookie) {
+            if (cookie) {
+                // paging cookies are only good on the server that issued them
+                cookie.replica = replica;
+            }
+            done(err, data, cookie);
+        });
+    }
+
+    if (pinned) {
+        var started = Date.now();
+        send(pinned, function(err) {
+            pinned.record(started, err);
+            fn.apply(this, arguments);
+        });
+        return this;
+    }
+    return this.read(send, fn);
+};
+
+ReplicaSet.prototype.compare = function(dn, attr, value, fn) {
+    return this.read(function(replica, done) {
+        replica.ldap.compare(dn, attr, value, done);
+    }, fn);
+};
+
+ReplicaSet.prototype.ismember = function(opt, fn) {
+    // many requests under the hood, so never hedged
+    var replica = this.ranked()[0];
+    var started = Date.now();
+    replica.ldap.ismember(opt, function(err) {
+        replica.record(started, err);
+        fn.apply(this, arguments);
+    });
+    return this;
+};
+
+function all(replicas, op, fn) {
+    var pending = replicas.length;
+    var succeeded = false;
+    var firsterr;
+
+    replicas.forEach(function(replica) {
+        op(replica, function(err) {
+            if (err) {
+                firsterr = firsterr || err;
+            } else {
+                succeeded = true;
+            }
+            if (--pending === 0) {
+                fn(succeeded ? undefined : firsterr);
+            }
+        });
+    });
+}
+
+ReplicaSet.prototype.bind = ReplicaSet.prototype.simplebind = function(opt, fn) {
+    if (typeof fn !== 'function') {
+        throw new LDAPError('Missing argument');
+    }
+    all(this.replicas, function(replica, done) {
+        replica.ldap.bind(opt, function(err) {
+            replica.unbound = !!err;
+            done(err);
+        });
+    }, fn);
+    return this;
+};
+
+ReplicaSet.prototype.saslbind = function(opt, fn) {
+    if (arguments.length == 1 && typeof arguments[0] === 'function') {
+        fn = opt;
+        opt = {};
+    }
+    all(this.replicas, function(replica, done) {
+        replica.ldap.saslbind(opt, function(err) {
+            replica.unbound = !!err;
+            done(err);
+        });
+    }, fn);
+    return this;
+};
+
+ReplicaSet.prototype.findandbind = function(opt, fn) {
+    // never hedged: the losing side would still go on to bind
+    var replica = this.ranked()[0];
+    var started = Date.now();
+    replica.ldap.findandbind(opt, function(err) {
+        replica.record(started, err);
+        fn.apply(this, arguments);
+    });
+    return this;
+};
+
+ReplicaSet.prototype.add = function(dn, attrs, fn) {
+    return this.write(function(replica, done) {
+        replica.ldap.add(dn, attrs, done);
+    }, fn);
+};
+
+ReplicaSet.prototype.modify = function(dn, ops, fn) {
+    return this.write(function(replica, done) {
+        replica.ldap.modify(dn, ops, done);
+    }, fn);
+};
+
+ReplicaSet.prototype.rename = function(dn, newrdn, fn) {
+    return this.write(function(replica, done) {
+        replica.ldap.rename(dn, newrdn, done);
+    }, fn);
+};
+
+ReplicaSet.prototype.remove = ReplicaSet.prototype.delete = function(dn, fn) {
+    return this.write(function(replica, done) {
+        replica.ldap.remove(dn, done);
+    }, fn);
+};
+
+ReplicaSet.prototype.close = function() {
+    this.replicas.forEach(function(replica) {
+        replica.up = false;
+        replica.ldap.close();
+    });
+};
+
+module.exports = ReplicaSet;
@@ -11,6 +11,9 @@ void LDAPCnx::SASLBind(const Nan::FunctionCallbackInfo<Value>& info) {
   if (ld->ld == NULL) {
     Nan::ThrowError("LDAP connection has not been established");
   }
+  if (ld->Busy(info, -1)) {
+    return;
+  }
 
   v8::String::Utf8Value mechanism(SASLDefaults::Get(info[0]));
   SASLDefaults defaults(info[1], info[2], info[3], info[4]);
@@ -0,0 +1,131 @@
+/*jshint globalstrict:true, node:true, trailing:true, unused:true */
+
+'use strict';
+
+// Relative share of sends each priority class gets while others are also
+// waiting. auth is high enough to behave as strict priority in practice
+// without being able to starve the others outright. Binds are not in any
+// class; see Scheduler.
+var WEIGHTS = {
+    auth:        64,
+    interactive: 8,
+    bulk:        1
+};
+
+var LATENCY_WEIGHT = 0.2;   // EWMA smoothing for the service times
+
+// Requests waiting for a free slot on one connection. Classes are served
+// by stride scheduling: each has a pass value that advances by 1/weight
+// whenever it sends, and the waiting class with the lowest pass goes
+// next. Within a class, requests go in arrival order.
+//
+// Binds (request.barrier) change the identity everything after them runs
+// under, so priority never moves anything across one: requests that
+// arrived before a waiting bind are sent first, then the bind once they
+// have all completed, and only then what arrived after it.
+function Scheduler(maxinflight) {
+    this.maxinflight = maxinflight > 0 ? maxinflight : Infinity;
+    this.classes     = {};
+    this.barriers    = [];
+    this.pass        = 0;
+    this.length      = 0;
+    this.latency     = {};    // EWMA service time per class, and for binds
+    this.seq         = 0;
+
+    Object.keys(WEIGHTS).forEach(function(name) {
+        this.classes[name] = { queue: [], pass: 0, stride: 1 / WEIGHTS[name] };
+    }, this);
+    return this;
+}
+
+Scheduler.prototype.known = function(priority) {
+    return this.classes[priority] !== undefined;
+};
+
+Scheduler.prototype.full = function(inflight) {
+    return inflight >= this.maxinflight;
+};
+
+Scheduler.prototype.push = function(request) {
+    request.seq = this.seq++;
+    this.length++;
+    if (request.barrier) {
+        this.barriers.push(request);
+        return;
+    }
+    var cls = this.classes[request.priority];
+    if (cls.queue.length === 0) {
+        // no credit for time spent idle
+        cls.pass = Math.max(cls.pass, this.pass);
+    }
+    cls.queue.push(request);
+};
+
+// The next request to send with inflight requests outstanding, or
+// undefined if everything waiting has to wait for those.
+Scheduler.prototype.shift = function(inflight) {
+    var barrier = this.barriers[0];
+    var next;
+    Object.keys(this.classes).forEach(function(name) {
+        var cls = this.classes[name];
+        if (cls.queue.length &&
+            (barrier === undefined || cls.queue[0].seq < barrier.seq) &&
+            (next === undefined || cls.pass < next.pass)) {
+            next = cls;
+        }
+    }, this);
+    if (next === undefined) {
+        if (barrier === undefined || inflight > 0) {
+            return undefined;
+        }
+        this.length--;
+        return this.barriers.shift();
+    }
+    this.pass = next.pass;
+    next.pass += next.stride;
+    this.length--;
+    return next.queue.shift();
+};
+
+Scheduler.prototype.remove = function(request) {
+    var queue = request.barrier ? this.barriers : this.classes[request.priority].queue;
+    var index = queue.indexOf(request);
+    if (index !== -1) {
+        queue.splice(index, 1);
+        this.length--;
+    }
+};
+
+// Everything still waiting in arrival order, emptying the scheduler.
+Scheduler.prototype.clear = function() {
+    var all = this.barriers;
+    this.barriers = [];
+    Object.keys(this.classes).forEach(function(name) {
+        all = all.concat(this.classes[name].queue);
+        this.classes[name].queue = [];
+    }, this);
+    this.length = 0;
+    return all.sort(function(a, b) {
+        return a.seq - b.seq;
+    });
+};
+
+// Service times are kept apart per class, so slow bulk exports don't
+// make quick auth and interactive requests look hopeless.
+function kind(request) {
+    return request.barrier ? 'bind' : request.priority;
+}
+
+Scheduler.prototype.observe = function(request, elapsed) {
+    var latency = this.latency[kind(request)];
+    this.latency[kind(request)] = latency === undefined ? elapsed :
+        latency + LATENCY_WEIGHT * (elapsed - latency);
+};
+
+// Would the request miss its deadline even if it were sent right now,
+// judging by others of its class?
+Scheduler.prototype.late = function(request, now) {
+    return now + (this.latency[kind(request)] || 0) > request.deadline;
+};
+
+module.exports = Scheduler;
@@ -0,0 +1,222 @@
+#include <dlfcn.h>
+#include <stdio.h>
+#include <string.h>
+#include "TLSContext.h"
+
+// OpenSSL is not linked directly: Node exports its own bundled copy, and
+// using one copy's functions on another copy's SSL objects would be fatal.
+// Instead each function is looked up in the global scope, the same lookup
+// the dynamic linker did for libldap's own SSL_* references. Whichever
+// copy won there (usually Node's) is the one that created libldap's
+// SSL_CTX and SSL objects, and it is the one found here.
+
+#define SSL_CTRL_GET_SESSION_REUSED      8
+#define SSL_CTRL_SET_SESS_CACHE_MODE     44
+#define SSL_SESS_CACHE_CLIENT            0x0001
+#define SSL_SESS_CACHE_NO_INTERNAL_STORE 0x0200
+
+typedef int (*NewSessionCallback)(void *ssl, void *session);
+
+// ldap_get_option(LDAP_OPT_X_TLS_CTX) hands out a new reference to the
+// context; this is libldap's way to drop one, whatever the TLS library.
+extern "C" void ldap_pvt_tls_ctx_free(void *ctx);
+
+static struct {
+  bool tried;
+  bool loaded;
+  int  (*set_session)(void *ssl, void *session);
+  void (*session_free)(void *session);
+  void (*sess_set_new_cb)(void *ctx, NewSessionCallback cb);
+  long (*ctx_ctrl)(void *ctx, int cmd, long larg, void *parg);
+  int  (*session_reused)(void *ssl);
+  long (*ssl_ctrl)(void *ssl, int cmd, long larg, void *parg);
+} openssl = { false, false, NULL, NULL, NULL, NULL, NULL, NULL };
+
+static bool LoadOpenSSL() {
+  if (openssl.tried) {
+    return openssl.loaded;
+  }
+  openssl.tried = true;
+
+#if defined(LDAP_OPT_X_TLS_PACKAGE) && defined(LDAP_OPT_X_TLS_CONNECT_CB)
+  char * package = NULL;
+  ldap_get_option(NULL, LDAP_OPT_X_TLS_PACKAGE, &package);
+  bool usable = package && !strcmp(package, "OpenSSL");
+  ldap_memfree(package);
+  if (!usable) {
+    return false;
+  }
+
+  *(void **)&openssl.set_session     = dlsym(RTLD_DEFAULT, "SSL_set_session");
+  *(void **)&openssl.session_free    = dlsym(RTLD_DEFAULT, "SSL_SESSION_free");
+  *(void **)&openssl.sess_set_new_cb = dlsym(RTLD_DEFAULT, "SSL_CTX_sess_set_new_cb");
+  *(void **)&openssl.ctx_ctrl        = dlsym(RTLD_DEFAULT, "SSL_CTX_ctrl");
+  // a macro over SSL_ctrl before OpenSSL 1.1
+  *(void **)&openssl.session_reused  = dlsym(RTLD_DEFAULT, "SSL_session_reused");
+  *(void **)&openssl.ssl_ctrl        = dlsym(RTLD_DEFAULT, "SSL_ctrl");
+  openssl.loaded = openssl.set_session && openssl.session_free &&
+                   openssl.sess_set_new_cb && openssl.ctx_ctrl;
+#endif
+  return openssl.loaded;
+}
+
+std::map<std::string, TLSContext *> TLSContext::contexts;
+std::map<void *, TLSContext::Pending> TLSContext::handshakes;
+uv_mutex_t TLSContext::lock;
+
+TLSContext::TLSContext(const std::string & key)
+  : key(key), refs(0), anchor(NULL), ctx(NULL) {
+}
+
+TLSContext::~TLSContext() {
+  for (std::map<std::string, void *>::iterator it = sessions.begin() ;
+       it != sessions.end() ; ++it) {
+    openssl.session_free(it->second);
+  }
+  if (ctx) {
+    ldap_pvt_tls_ctx_free(ctx);
+  }
+  if (anchor) {
+    ldap_unbind_ext(anchor, NULL, NULL);
+  }
+}
+
+// Connections with the same settings share a context. Only called on the
+// loop thread.
+
+TLSContext * TLSContext::Acquire(int verifycert) {
+  static bool initialized = false;
+  if (!initialized) {
+    uv_mutex_init(&lock);
+    initialized = true;
+  }
+
+  char key[32];
+  snprintf(key, sizeof(key), "verifycert=%d", verifycert);
+
+  std::map<std::string, TLSContext *>::iterator it = contexts.find(key);
+  if (it != contexts.end()) {
+    it->second->refs++;
+    return it->second;
+  }
+
+  TLSContext * context = new TLSContext(key);
+  if (!context->Init(verifycert)) {
+    delete context;
+    return NULL;
+  }
+  context->refs = 1;
+  contexts[key] = context;
+  return context;
+}
+
+void TLSContext::Release() {
+  if (--refs > 0) {
+    return;
+  }
+  contexts.erase(key);
+
+  uv_mutex_lock(&lock);
+  for (std::map<void *, Pending>::iterator it = handshakes.begin() ;
+       it != handshakes.end() ; ) {
+    if (it->second.context == this) {
+      handshakes.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  uv_mutex_unlock(&lock);
+
+  delete this;
+}
+
+// libldap builds the context from the options of the handle it is set
+// on, so a handle that never connects serves as its owner.
+
+bool TLSContext::Init(int verifycert) {
+  int zero = 0;
+
+  if (ldap_initialize(&anchor, NULL) != LDAP_SUCCESS) {
+    anchor = NULL;
+    return false;
+  }
+  ldap_set_option(anchor, LDAP_OPT_X_TLS_REQUIRE_CERT, &verifycert);
+  if (ldap_set_option(anchor, LDAP_OPT_X_TLS_NEWCTX, &zero) != LDAP_OPT_SUCCESS) {
+    return false;
+  }
+  ldap_get_option(anchor, LDAP_OPT_X_TLS_CTX, &ctx);
+  if (ctx == NULL) {
+    return false;
+  }
+
+  if (LoadOpenSSL()) {
+    // Hand every new client session to OnNewSession; with TLS 1.3 these
+    // arrive as tickets after the handshake rather than during it.
+    openssl.ctx_ctrl(ctx, SSL_CTRL_SET_SESS_CACHE_MODE,
+                     SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE,
+                     NULL);
+    openssl.sess_set_new_cb(ctx, OnNewSession);
+  }
+  return true;
+}
+
+// The handshake runs wherever libldap connects, which may be a threadpool
+// worker, so session bookkeeping is done under the lock.
+
+void TLSContext::Resume(void * ssl, const std::string & peer) {
+  if (!openssl.loaded) {
+    return;
+  }
+  uv_mutex_lock(&lock);
+  std::map<std::string, void *>::iterator it = sessions.find(peer);
+  if (it != sessions.end()) {
+    openssl.set_session(ssl, it->second);
+  }
+  Pending pending = { this, peer };
+  handshakes[ssl] = pending;
+  uv_mutex_unlock(&lock);
+}
+
+bool TLSContext::Resumable() {
+  return openssl.loaded;
+}
+
+bool TLSContext::Resumed(void * ssl) {
+  if (!openssl.loaded || ssl == NULL) {
+    return false;
+  }
+  if (openssl.session_reused) {
+    return openssl.session_reused(ssl) == 1;
+  }
+  return openssl.ssl_ctrl &&
+         openssl.ssl_ctrl(ssl, SSL_CTRL_GET_SESSION_REUSED, 0, NULL) == 1;
+}
+
+void TLSContext::Forget(void * ssl) {
+  if (!openssl.loaded) {
+    return;
+  }
+  uv_mutex_lock(&lock);
+  handshakes.erase(ssl);
+  uv_mutex_unlock(&lock);
+}
+
+int TLSContext::OnNewSession(void * ssl, void * session) {
+  int kept = 0;
+
+  uv_mutex_lock(&lock);
+  std::map<void *, Pending>::iterator it = handshakes.find(ssl);
+  if (it != handshakes.end()) {
+    std::map<std::string, void *> & sessions = it->second.context->sessions;
+    std::map<std::string, void *>::iterator old = sessions.find(it->second.peer);
+    if (old != sessions.end()) {
+      openssl.session_free(old->second);
+    }
+    sessions[it->second.peer] = session;
+    kept = 1;
+  }
+  uv_mutex_unlock(&lock);
+
+  // returning 1 tells OpenSSL we kept the reference
+  return kept;
+}
@@ -0,0 +1,54 @@
+#ifndef TLSCONTEXT_H
+#define TLSCONTEXT_H
+
+#include <uv.h>
+#include <ldap.h>
+#include <map>
+#include <string>
+
+// A libldap TLS context shared by every connection opened with the same
+// TLS settings, so CA bundles are loaded once rather than per handle.
+// When libldap is built against OpenSSL, the context also keeps the last
+// session issued by each server so reconnects resume it with an
+// abbreviated handshake.
+
+class TLSContext {
+ public:
+  static TLSContext * Acquire(int verifycert);
+  void Release();
+
+  void * Context() const { return ctx; }
+
+  // Called from libldap's TLS connect callback, before the handshake.
+  void Resume(void * ssl, const std::string & peer);
+  static void Forget(void * ssl);
+
+  // Whether sessions can be resumed at all (libldap uses OpenSSL), and
+  // whether the handshake on ssl resumed an earlier one.
+  static bool Resumable();
+  static bool Resumed(void * ssl);
+
+ private:
+  TLSContext(const std::string & key);
+  ~TLSContext();
+
+  bool Init(int verifycert);
+  static int OnNewSession(void * ssl, void * session);
+
+  struct Pending {
+    TLSContext * context;
+    std::string peer;
+  };
+
+  static std::map<std::string, TLSContext *> contexts;
+  static std::map<void *, Pending> handshakes;
+  static uv_mutex_t lock;
+
+  std::string key;
+  int refs;
+  LDAP * anchor;    // owns ctx for as long as any connection uses it
+  void * ctx;
+  std::map<std::string, void *> sessions;
+};
+
+#endif
@@ -3,7 +3,8 @@
         {
             "target_name": "LDAPCnx",
             "sources": [ "LDAP.cc", "LDAPCnx.cc", "LDAPCookie.cc", 
-              "LDAPSASL.cc", "LDAPXSASL.cc", "SASLDefaults.cc" ],
+              "LDAPSASL.cc", "LDAPXSASL.cc", "SASLDefaults.cc",
+              "TLSContext.cc" ],
             "include_dirs" : [
  	 	"<!(node -e \"require('nan')\")",
                 "/usr/local/include"
@@ -24,12 +25,16 @@
             "conditions": [
                 [ "SASL==\"n\"", { "sources!": 
                   ["LDAPSASL.cc", "SASLDefaults.cc"] } ], 
-                [ "SASL==\"y\"", { "sources!": ["LDAPXSASL.cc"] } ]
+                [ "SASL==\"y\"", { "sources!": ["LDAPXSASL.cc"] } ],
+                [ "OS==\"linux\"", { "libraries": [ "-ldl" ] } ],
+                [ "LDAP_R==\"y\"", { "libraries!": [ "-lldap" ],
+                  "libraries": [ "-lldap_r" ] } ]
             ]
         }
     ],
     "variables": {
-      "SASL": "<!(test -f /usr/include/sasl/sasl.h && echo y || echo n)"
+      "SASL": "<!(test -f /usr/include/sasl/sasl.h && echo y || echo n)",
+      "LDAP_R": "<!(ls /usr/lib/libldap_r.* /usr/lib/*/libldap_r.* /usr/local/lib/libldap_r.* 2>/dev/null | grep -q . && echo y || echo n)"
     },
     "conditions": [
         [
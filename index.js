@@ -4,8 +4,10 @@
 
 var binding = require('bindings')('LDAPCnx');
 var LDAPError = require('./LDAPError');
+var Scheduler = require('./LDAPScheduler');
 var assert = require('assert');
 var util = require('util');
+var url = require('url');
 
 function arg(val, def) {
     if (val !== undefined) {
@@ -52,6 +54,22 @@ var escapes = {
     }
 };
 
+// Layouts a search can return its entries in; see LDAPCnx::Entries*
+var formats = {
+    object:  0,
+    columns: 1,
+    packed:  2
+};
+
+// View a Buffer of native-endian uint32s as a Uint32Array, without a copy
+// when it is suitably aligned.
+function uint32view(buf) {
+    if (buf.byteOffset % 4 === 0) {
+        return new Uint32Array(buf.buffer, buf.byteOffset, buf.length / 4);
+    }
+    return new Uint32Array(new Uint8Array(buf).buffer);
+}
+
 function Stats() {
     this.lateresponses = 0;
     this.reconnects    = 0;
@@ -64,13 +82,94 @@ function Stats() {
     this.adds          = 0;
     this.removes       = 0;
     this.renames       = 0;
+    this.compares      = 0;
+    this.referrals     = 0;
     this.disconnects   = 0;
     this.results       = 0;
+    this.shed          = 0;
+    this.tlsresumes    = 0;
     return this;
 }
 
+// A request made through enqueue. It can be cancelled whether it is still
+// held or already sent; either way its callback is not called afterwards.
+// Binds are barriers: see Scheduler.
+function Request(ldap, send, fn, priority, barrier) {
+    this.ldap     = ldap;
+    this.send     = send;
+    this.fn       = fn;
+    this.priority = priority;
+    this.barrier  = barrier === true;
+    this.deadline = Date.now() + ldap.options.timeout;
+    this.msgid    = undefined;
+    return this;
+}
+
+Request.prototype.cancel = function() {
+    if (this.msgid !== undefined) {
+        return this.ldap.abandon(this.msgid);
+    }
+    clearTimeout(this.fn.timer);
+    this.ldap.scheduler.remove(this);
+    return undefined;
+};
+
+// Bounded, least-recently-used set of connections opened to follow
+// referrals. Connections with requests still outstanding are never
+// evicted, so the cache may briefly exceed its size under load.
+function ReferralCache(size) {
+    this.size    = size;
+    this.entries = {};
+    this.order   = [];
+    return this;
+}
+
+ReferralCache.prototype.get = function(uri) {
+    var entry = this.entries[uri];
+    if (entry !== undefined) {
+        this.order.splice(this.order.indexOf(uri), 1);
+        this.order.push(uri);
+    }
+    return entry;
+};
+
+ReferralCache.prototype.set = function(uri, entry) {
+    for (var i = 0 ; i < this.order.length && this.order.length >= this.size ; ) {
+        var victim = this.entries[this.order[i]];
+        if (victim.ready && Object.keys(victim.ldap.queue).length === 0) {
+            this.remove(this.order[i]);
+        } else {
+            i++;
+        }
+    }
+    this.entries[uri] = entry;
+    this.order.push(uri);
+};
+
+ReferralCache.prototype.remove = function(uri) {
+    var entry = this.entries[uri];
+    if (entry === undefined) {
+        return;
+    }
+    if (entry.ldap !== undefined && entry.ldap.ld !== undefined) {
+        entry.ldap.close();
+    }
+    delete this.entries[uri];
+    this.order.splice(this.order.indexOf(uri), 1);
+};
+
+ReferralCache.prototype.clear = function() {
+    while (this.order.length) {
+        this.remove(this.order[0]);
+    }
+};
+
 function LDAP(opt, fn) {
     this.queue = {};
+    this.inflight = 0;
+    this.binding = undefined;   // msgid of the bind in flight, if any
+    this.connected = false;
+    this.connecting = false;
     this.stats = new Stats();
 
     this.options = extendobj({
@@ -78,15 +177,24 @@ function LDAP(opt, fn) {
         filter:       '(objectClass=*)',
         scope:        2,
         attrs:        '*',
+        format:       'object',
         ntimeout:     1000,
         timeout:      2000,
         debug:        0,
         validatecert: LDAP.LDAP_OPT_X_TLS_HARD,
+        sharetls:     false,
+        maxinflight:  0,
+        priority:     'interactive',
         referrals:    0,
+        referralhops: 4,
+        referralcache: 8,
+        referralhosts: [],
         connect:      function() {},
         disconnect:   function() {}
     }, opt);
 
+    this.scheduler = new Scheduler(this.options.maxinflight);
+
     if (typeof this.options.uri === 'string') {
         this.options.uri = [ this.options.uri ];
     }
@@ -98,44 +206,225 @@ function LDAP(opt, fn) {
                                   this.options.ntimeout,
                                   this.options.debug,
                                   this.options.validatecert,
-                                  this.options.referrals);
+                                  this.options.sharetls ? 1 : 0,
+                                  this.options.timeout);
                                   
     if (typeof fn !== 'function') {
         fn = function() {};
     }
 
-    return this.enqueue(this.ld.bind(undefined, undefined), fn);
+    this.reconnect(fn);
+    return this;
 }
 
+// Connection setup blocks a libuv threadpool thread (4 by default, and
+// shared with fs, DNS and crypto) for up to ntimeout per server plus the
+// request timeout for the initial bind, so only LDAP.maxconnects of them
+// run at once across all connections. The rest wait their turn. run is
+// handed a function to call once the slot is free again; it is released
+// for run if run throws.
+var setup = { running: 0, waiting: [] };
+
+function setupslot(run) {
+    if (setup.running >= LDAP.maxconnects) {
+        setup.waiting.push(run);
+        return;
+    }
+    setup.running++;
+
+    var released = false;
+    function done() {
+        if (!released) {
+            released = true;
+            setup.running--;
+            if (setup.waiting.length) {
+                setupslot(setup.waiting.shift());
+            }
+        }
+    }
+    try {
+        run(done);
+    } catch (e) {
+        done();
+        throw e;
+    }
+}
+
+// Establish the connection (TCP, ldaps:// handshake and an anonymous bind)
+// off the event loop. Requests made meanwhile are held in the scheduler
+// and sent once the connection is up.
+LDAP.prototype.reconnect = function(fn) {
+    if (this.connecting || this.ld === undefined) {
+        return;
+    }
+    this.connecting = true;
+    this.connected = false;
+    setupslot(function connect(done) {
+        if (this.ld === undefined) {
+            this.connecting = false;
+            return done();
+        }
+        this.ld.connect(function connected(err) {
+            done();
+            this.connecting = false;
+            if (this.ld === undefined) {
+                return;
+            }
+            // a refused anonymous bind still leaves us with a usable
+            // connection, one that never answered it does not
+            this.connected = !err ||
+                (err.message !== 'Timed out' && this.ld.fd() >= 0);
+            this.checkresumed();
+            this.flush(this.connected ? undefined : err);
+            if (typeof fn === 'function') {
+                fn(err);
+            }
+        }.bind(this));
+        return undefined;
+    }.bind(this));
+};
+
+// Fail every held request if the connection could not be made,
+// otherwise send as many as the scheduler allows.
+LDAP.prototype.flush = function(err) {
+    if (!err) {
+        return this.drain();
+    }
+    this.scheduler.clear().forEach(function(held) {
+        clearTimeout(held.fn.timer);
+        this.stats.errors++;
+        held.fn(err);
+    }, this);
+};
+
+// Send held requests while there are free slots. A request that would
+// miss its deadline even if sent now is failed instead, sparing the
+// server work nobody will wait for.
+LDAP.prototype.drain = function() {
+    while (this.connected && this.binding === undefined &&
+           this.scheduler.length && !this.scheduler.full(this.inflight)) {
+        var held = this.scheduler.shift(this.inflight);
+        if (held === undefined) {
+            break;
+        }
+        var now = Date.now();
+        clearTimeout(held.fn.timer);
+        if (this.scheduler.late(held, now)) {
+            this.stats.shed++;
+            process.nextTick(held.fn.bind(null, new LDAPError('Deadline exceeded')));
+            continue;
+        }
+        try {
+            this.send(held, held.deadline - now);
+        } catch (e) {
+            held.fn(e);
+        }
+    }
+};
+
+// Requests made by the connect handler (typically a bind) set up the new
+// connection, so they go ahead of those held while reconnecting.
 LDAP.prototype.onconnect = function() {
+    var held = this.scheduler.clear();
     this.stats.reconnects++;
-    return this.options.connect.call(this);
+    var result = this.options.connect.call(this);
+    held.forEach(function(request) {
+        this.scheduler.push(request);
+    }, this);
+    return result;
 };
 
 LDAP.prototype.ondisconnect = function() {
     this.stats.disconnects++;
+    this.connected = false;
+    // no answer to a bind in flight is coming now
+    this.binding = undefined;
+    // reconnect once libldap has unwound, so the next request doesn't
+    // have to wait for the connection
+    setImmediate(this.reconnect.bind(this, undefined));
     this.options.disconnect();
 };
 
 LDAP.prototype.starttls = function(fn) {
-    return this.enqueue(this.ld.starttls(), fn);
+    this.enqueue(function() {
+        return this.ld.starttls();
+    }, function starttlsResult(err) {
+        if (err) {
+            return fn(err);
+        }
+        this.installtls(fn);
+    }.bind(this), undefined, true);
+    return this;
 };
 
-LDAP.prototype.installtls = function() {
-    return this.ld.installtls();
+// Without a callback this performs the TLS handshake synchronously, as
+// before. With one, the handshake runs off the event loop and requests
+// are held until it completes. If it fails the connection is closed and
+// the held requests fail with it, rather than going out in the clear.
+LDAP.prototype.installtls = function(fn) {
+    if (typeof fn !== 'function') {
+        return this.ld.installtls();
+    }
+    if (this.connecting) {
+        process.nextTick(fn.bind(null, new LDAPError('Connection setup already in progress')));
+        return undefined;
+    }
+    this.connected = false;
+    this.connecting = true;
+    setupslot(function handshake(done) {
+        if (this.ld === undefined) {
+            this.connecting = false;
+            done();
+            return fn(new LDAPError('Connection closed'));
+        }
+        this.ld.installtls(function tlsInstalled(err) {
+            done();
+            this.connecting = false;
+            if (this.ld === undefined) {
+                return fn(err);
+            }
+            if (err) {
+                this.flush(err);
+                this.close();
+                return fn(err);
+            }
+            this.connected = true;
+            this.checkresumed();
+            this.flush();
+            return fn();
+        }.bind(this));
+        return undefined;
+    }.bind(this));
+    return undefined;
 };
 
 LDAP.prototype.tlsactive = function() {
     return this.ld.checktls();
 };
 
+// Whether this connection's handshakes can resume TLS sessions: it uses
+// sharetls, and libldap was built with OpenSSL.
+LDAP.prototype.tlsresumable = function() {
+    return this.ld.tlsresumable();
+};
+
+// Count handshakes that resumed a session from a shared TLS context.
+LDAP.prototype.checkresumed = function() {
+    if (this.connected && this.ld.tlsresumed()) {
+        this.stats.tlsresumes++;
+    }
+};
+
 LDAP.prototype.remove = LDAP.prototype.delete  = function(dn, fn) {
     this.stats.removes++;
     if (typeof dn !== 'string' ||
         typeof fn !== 'function') {
         throw new LDAPError('Missing argument');
     }
-    return this.enqueue(this.ld.delete(dn), fn);
+    this.enqueue(function() {
+        return this.ld.delete(dn);
+    }, fn);
+    return this;
 };
 
 LDAP.prototype.bind = LDAP.prototype.simplebind = function(opt, fn) {
@@ -146,7 +435,15 @@ LDAP.prototype.bind = LDAP.prototype.simplebind = function(opt, fn) {
         typeof fn           !== 'function') {
         throw new LDAPError('Missing argument');
     }
-    return this.enqueue(this.ld.bind(opt.binddn, opt.password), fn);
+    this.enqueue(function() {
+        return this.ld.bind(opt.binddn, opt.password);
+    }, function bindResult(err) {
+        if (!err) {
+            this.credentials = { binddn: opt.binddn, password: opt.password };
+        }
+        fn(err);
+    }.bind(this), undefined, true);
+    return this;
 };
 
 LDAP.prototype.saslbind = function(opt, fn) {
@@ -169,7 +466,15 @@ LDAP.prototype.saslbind = function(opt, fn) {
        throw new LDAPError('Invalid argument');
     }
 
-    return this.enqueue(this.ld.saslbind.apply(this.ld, args), fn);
+    this.enqueue(function() {
+        return this.ld.saslbind.apply(this.ld, args);
+    }, function saslbindResult(err) {
+        if (!err) {
+            this.credentials = { sasl: opt || {} };
+        }
+        fn(err);
+    }.bind(this), undefined, true);
+    return this;
 };
 
 LDAP.prototype.add = function(dn, attrs, fn) {
@@ -178,21 +483,161 @@ LDAP.prototype.add = function(dn, attrs, fn) {
         typeof attrs !== 'object') {
         throw new LDAPError('Missing argument');
     }
-    return this.enqueue(this.ld.add(dn, attrs), fn);
+    this.enqueue(function() {
+        return this.ld.add(dn, attrs);
+    }, fn);
+    return this;
 };
 
 LDAP.prototype.search = function(opt, fn) {
     this.stats.searches++;
-    return this.enqueue(this.ld.search(arg(opt.base   , this.options.base),
-                                       arg(opt.filter , this.options.filter),
-                                       arg(opt.attrs  , this.options.attrs),
-                                       arg(opt.scope  , this.options.scope),
-                                       arg(opt.pagesize, this.options.pagesize),
-                                       arg(opt.cookie,  null)
-                                       ), unwrap_cookie);
-    function unwrap_cookie(err, data) {
-      err ? fn(err) : fn(err, data.data, data.cookie);
+    var search = {
+        base:         arg(opt.base   , this.options.base),
+        filter:       arg(opt.filter , this.options.filter),
+        attrs:        arg(opt.attrs  , this.options.attrs),
+        scope:        arg(opt.scope  , this.options.scope),
+        referralhops: arg(opt.referralhops, this.options.referralhops),
+        format:       arg(opt.format, this.options.format),
+        priority:     opt.priority
+    };
+    if (formats[search.format] === undefined) {
+        throw new LDAPError('Unknown result format ' + search.format);
     }
+    this.enqueue(function() {
+        return this.ld.search(search.base,
+                              search.filter,
+                              search.attrs,
+                              search.scope,
+                              arg(opt.pagesize, this.options.pagesize),
+                              arg(opt.cookie,  null),
+                              formats[search.format]);
+    }, function unwrap_cookie(err, data) {
+        if (data !== undefined && data.referrals !== undefined &&
+            this.options.referrals && search.referralhops > 0 &&
+            search.format === 'object') {
+            return this.chase(search, err, data, fn);
+        }
+        if (!err && search.format === 'packed') {
+            data.data.index = uint32view(data.data.index);
+            data.data.offsets = uint32view(data.data.offsets);
+        }
+        err ? fn(err) : fn(err, data.data, data.cookie);
+    }.bind(this), opt.priority);
+    return this;
+};
+
+// Continue a search on every server it was referred to, in parallel,
+// and hand back the original entries merged with theirs. An error other
+// than the referral itself (a size limit, say) is still reported, along
+// with everything found.
+LDAP.prototype.chase = function(search, err, data, fn) {
+    var referred = err !== undefined && err.message === 'Referral';
+    var results = referred ? [] : data.data;
+    var pending = data.referrals.length;
+    var firsterr = referred ? undefined : err;
+
+    this.stats.referrals += pending;
+
+    data.referrals.forEach(function chaseReferral(ref) {
+        if (ref.uri === undefined) {
+            return done(new LDAPError('Bad referral: ' + ref.url));
+        }
+        this.referral(ref.uri, function referralReady(err, conn) {
+            if (err) {
+                return done(err);
+            }
+            conn.search({
+                base:         arg(ref.base,   search.base),
+                filter:       arg(ref.filter, search.filter),
+                attrs:        search.attrs,
+                scope:        arg(ref.scope,  search.scope),
+                referralhops: search.referralhops - 1,
+                format:       'object',
+                priority:     search.priority
+            }, done);
+        });
+    }, this);
+
+    function done(err, res) {
+        if (err) {
+            firsterr = firsterr || err;
+        } else {
+            results = results.concat(res);
+        }
+        if (--pending === 0) {
+            fn(firsterr, results, data.cookie);
+        }
+    }
+};
+
+// Hand fn a connection to uri, bound with the same credentials as this
+// one if uri is trusted with them, anonymous otherwise. Connections are
+// reused from a bounded cache.
+LDAP.prototype.referral = function(uri, fn) {
+    if (this.referralcache === undefined) {
+        this.referralcache = new ReferralCache(this.options.referralcache);
+    }
+
+    var entry = this.referralcache.get(uri);
+    if (entry !== undefined) {
+        return entry.ready ? fn(undefined, entry.ldap) : entry.waiting.push(fn);
+    }
+
+    var cache = this.referralcache;
+    var rebind = this.trusts(uri) ? this.rebind.bind(this) :
+        function anonymous(target, fn) { fn(); };
+    entry = { ready: false, waiting: [ fn ] };
+    cache.set(uri, entry);
+    entry.ldap = new LDAP(extendobj(extendobj({}, this.options), {
+        uri: uri,
+        connect: function referralReconnect() {
+            if (entry.ready) {
+                rebind(this, function() {});
+            }
+        },
+        disconnect: function() {}
+    }), function referralConnected(err) {
+        if (err) {
+            return ready(err);
+        }
+        rebind(entry.ldap, ready);
+    });
+
+    function ready(err) {
+        var waiting = entry.waiting;
+        entry.waiting = [];
+        if (err) {
+            cache.remove(uri);
+        } else {
+            entry.ready = true;
+        }
+        waiting.forEach(function(waiter) {
+            err ? waiter(err) : waiter(undefined, entry.ldap);
+        });
+    }
+    return undefined;
+};
+
+// A referral can name any host, so credentials only follow it to servers
+// listed in referralhosts, and only over ldaps://.
+LDAP.prototype.trusts = function(uri) {
+    var parsed = url.parse(uri);
+    return parsed.protocol === 'ldaps:' &&
+        this.options.referralhosts.some(function(host) {
+            return host.toLowerCase() === parsed.hostname;
+        });
+};
+
+// Authenticate target the same way this connection was last bound.
+LDAP.prototype.rebind = function(target, fn) {
+    var cred = this.credentials;
+    if (cred === undefined) {
+        return fn();
+    }
+    if (cred.sasl !== undefined) {
+        return target.saslbind(cred.sasl, fn);
+    }
+    return target.bind(cred, fn);
 };
 
 LDAP.prototype.rename = function(dn, newrdn, fn) {
@@ -202,7 +647,109 @@ LDAP.prototype.rename = function(dn, newrdn, fn) {
         typeof fn     !== 'function') {
         throw new LDAPError('Missing argument');
        }
-    return this.enqueue(this.ld.rename(dn, newrdn), fn);
+    this.enqueue(function() {
+        return this.ld.rename(dn, newrdn);
+    }, fn);
+    return this;
+};
+
+LDAP.prototype.compare = function(dn, attr, value, fn) {
+    this.stats.compares++;
+    if (typeof dn   !== 'string' ||
+        typeof attr !== 'string' ||
+        value       === undefined ||
+        typeof fn   !== 'function') {
+        throw new LDAPError('Missing argument');
+    }
+    this.enqueue(function() {
+        return this.ld.compare(dn, attr, value);
+    }, fn);
+    return this;
+};
+
+// Check which of opt.members belong to opt.group, answering with an
+// object mapping each member DN to true or false. By default this
+// pipelines one compare per member against the group's member attribute
+// (opt.attr), so the group itself is never transferred. With opt.nested,
+// it instead runs a search using Active Directory's in-chain matching
+// rule, which also sees membership through nested groups.
+LDAP.prototype.ismember = function(opt, fn) {
+    if (opt               === undefined ||
+        typeof opt.group  !== 'string' ||
+        !Array.isArray(opt.members) ||
+        typeof fn         !== 'function') {
+        throw new LDAPError('Missing argument');
+    }
+
+    var result = {};
+    var pending = opt.members.length;
+    var failed = false;
+
+    function done(err) {
+        if (failed) {
+            return;
+        }
+        if (err) {
+            failed = true;
+            return fn(err);
+        }
+        if (--pending === 0) {
+            fn(undefined, result);
+        }
+    }
+
+    if (pending === 0) {
+        process.nextTick(fn.bind(this, undefined, result));
+        return this;
+    }
+
+    if (!opt.nested) {
+        this.stats.compares += pending;
+        opt.members.forEach(function(member) {
+            this.enqueue(function() {
+                return this.ld.compare(opt.group, arg(opt.attr, 'member'), member);
+            }, function(err, ismember) {
+                result[member] = ismember;
+                done(err);
+            }, opt.priority);
+        }, this);
+        return this;
+    }
+
+    // one search per batch of members, keeping filters a sane size
+    var batch = 100;
+    var ingroup = '(memberOf:1.2.840.113556.1.4.1941:=' +
+        stringescape(escapes.filter, opt.group) + ')';
+    pending = Math.ceil(opt.members.length / batch);
+    for (var i = 0 ; i < opt.members.length ; i += batch) {
+        var members = opt.members.slice(i, i + batch);
+        var bydn = {};
+        members.forEach(function(member) {
+            result[member] = false;
+            bydn[member.toLowerCase()] = member;
+        });
+        this.search({
+            base:     arg(opt.base, this.options.base),
+            scope:    LDAP.SUBTREE,
+            attrs:    '1.1',
+            format:   'object',
+            priority: opt.priority,
+            filter: '(&' + ingroup + '(|' + members.map(function(member) {
+                return '(distinguishedName=' + stringescape(escapes.filter, member) + ')';
+            }).join('') + '))'
+        }, function(bydn, err, data) {
+            if (!err) {
+                data.forEach(function(entry) {
+                    var member = bydn[entry.dn.toLowerCase()];
+                    if (member !== undefined) {
+                        result[member] = true;
+                    }
+                });
+            }
+            done(err);
+        }.bind(this, bydn));
+    }
+    return this;
 };
 
 LDAP.prototype.modify = function(dn, ops, fn) {
@@ -212,7 +759,10 @@ LDAP.prototype.modify = function(dn, ops, fn) {
         typeof fn  !== 'function') {
         throw new LDAPError('Missing argument');
     }
-    return this.enqueue(this.ld.modify(dn, ops), fn);
+    this.enqueue(function() {
+        return this.ld.modify(dn, ops);
+    }, fn);
+    return this;
 };
 
 LDAP.prototype.findandbind = function(opt, fn) {
@@ -221,7 +771,8 @@ LDAP.prototype.findandbind = function(opt, fn) {
             throw new Error('Missing argument');
         }
 
-    this.search(opt, function findandbindFind(err, data) {
+    // the search is on a login path, but a user given priority wins
+    this.search(extendobj({ priority: 'auth' }, opt), function findandbindFind(err, data) {
         if (err) return fn(err);
 
         if (data === undefined || data.length != 1) {
@@ -251,24 +802,77 @@ LDAP.prototype.close = function() {
     if (this.auth_connection !== undefined) {
         this.auth_connection.close();
     }
+    if (this.referralcache !== undefined) {
+        this.referralcache.clear();
+    }
+    this.connected = false;
     this.ld.close();
     this.ld = undefined;
 };
 
+LDAP.prototype.abandon = function(msgid) {
+    if (this.queue[msgid]) {
+        clearTimeout(this.queue[msgid].timer);
+        this.settle(msgid);
+        delete this.queue[msgid];
+        this.ld.abandon(msgid);
+        this.inflight--;
+        this.drain();
+    }
+};
+
 LDAP.prototype.dequeue = function(err, msgid, data) {
     this.stats.results++;
     if (this.queue[msgid]) {
         clearTimeout(this.queue[msgid].timer);
+        this.settle(msgid);
+        this.inflight--;
+        this.scheduler.observe(this.queue[msgid].request,
+                               Date.now() - this.queue[msgid].sent);
         this.queue[msgid](err, data);
         delete this.queue[msgid];
+        this.drain();
     } else {
         this.stats.lateresponses++;
     }
 };
 
-LDAP.prototype.enqueue = function(msgid, fn) {
+// The request is sent now if nothing stands in its way, otherwise held in
+// the scheduler. A bind (barrier) also has to wait for everything sent
+// before it, and everything after it waits for the bind.
+LDAP.prototype.enqueue = function(send, fn, priority, barrier) {
+    priority = priority || this.options.priority;
+    if (!this.scheduler.known(priority)) {
+        throw new LDAPError('Unknown priority ' + priority);
+    }
+    var request = new Request(this, send, fn, priority, barrier);
+    this.lastrequest = request;
+    if (this.ld !== undefined &&
+        (!this.connected || this.scheduler.full(this.inflight) ||
+         this.scheduler.length || this.binding !== undefined ||
+         (request.barrier && this.inflight > 0))) {
+        fn.timer = setTimeout(function heldTimeout() {
+            this.scheduler.remove(request);
+            fn(new LDAPError('Timeout'));
+            this.stats.timeouts++;
+        }.bind(this), this.options.timeout);
+        this.scheduler.push(request);
+        if (!this.connected) {
+            this.reconnect();
+        }
+        return request;
+    }
+    this.send(request, this.options.timeout);
+    return request;
+};
+
+LDAP.prototype.send = function(request, timeout) {
+    var fn = request.fn;
+    var msgid = this.ld === undefined ? -1 : request.send.call(this);
+
     if (msgid == -1 || this.ld === undefined) {
-        if (this.ld.errorstring() === 'Can\'t contact LDAP server') {
+        if (this.ld !== undefined &&
+            this.ld.errorstring() === 'Can\'t contact LDAP server') {
             // this means we have had a disconnect event, but since there
             // are still requests outstanding from libldap's perspective,
             // the connection isn't "closed" and the disconnect event has
@@ -277,28 +881,50 @@ LDAP.prototype.enqueue = function(msgid, fn) {
             // we're not missing one for some reason. Only once we've
             // abandoned everything does the handle properly close.
             Object.keys(this.queue).forEach(function fireTimeout(msgid) {
+                clearTimeout(this.queue[msgid].timer);
                 this.queue[msgid](new LDAPError('Timeout'));
                 delete this.queue[msgid];
                 this.ld.abandon(msgid);
             }.bind(this));
+            this.inflight = 0;
+            this.binding = undefined;
         } 
+        var message = this.ld === undefined ? 'Connection closed' : this.ld.errorstring();
         process.nextTick(function emitError() {
-            fn(new LDAPError(this.ld.errorstring()));
-        }.bind(this));
+            fn(new LDAPError(message));
+        });
         this.stats.errors++;
         return this;
     }
     fn.timer = setTimeout(function searchTimeout() {
         this.ld.abandon(msgid);
+        this.settle(msgid);
         delete this.queue[msgid];
+        this.inflight--;
         fn(new LDAPError('Timeout'));
         this.stats.timeouts++;
-    }.bind(this), this.options.timeout);
+        this.drain();
+    }.bind(this), timeout);
+    fn.sent = Date.now();
+    fn.request = request;
+    this.inflight++;
     this.queue[msgid] = fn;
+    request.msgid = msgid;
+    if (request.barrier) {
+        this.binding = msgid;
+    }
     this.stats.requests++;
     return this;
 };
 
+// A request is done with; if it was the bind in flight, what waited
+// behind it may go.
+LDAP.prototype.settle = function(msgid) {
+    if (this.binding === Number(msgid)) {
+        this.binding = undefined;
+    }
+};
+
 function stringescape(escapes_obj, str) {
     return str.replace(escapes_obj.regex, function (match) {
         return escapes_obj.replacements[match];
@@ -334,4 +960,8 @@ setConst(LDAP, 'LDAP_OPT_X_TLS_DEMAND', 2);
 setConst(LDAP, 'LDAP_OPT_X_TLS_ALLOW',  3);
 setConst(LDAP, 'LDAP_OPT_X_TLS_TRY',    4);
 
+LDAP.maxconnects = 2;
+
+LDAP.ReplicaSet = require('./LDAPReplicaSet');
+
 module.exports = LDAP;
@@ -64,6 +64,75 @@ describe('LDAP', function() {
             done();
         });
     });
+    it ('Should return columns', function(done) {
+        ldap.search({
+            base: 'dc=sample,dc=com',
+            filter: '(|(cn=albert)(cn=babs))',
+            attrs: 'cn sn',
+            format: 'columns'
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.equal(res.dn.length, 2);
+            assert.equal(res.cn.length, 2);
+            var babs = res.dn.indexOf('cn=Babs,dc=sample,dc=com');
+            assert.notEqual(babs, -1);
+            assert.equal(res.sn[babs][0], 'Jensen');
+            done();
+        });
+    });
+    it ('Should return packed results', function(done) {
+        ldap.search({
+            base: 'dc=sample,dc=com',
+            filter: '(cn=babs)',
+            attrs: 'sn',
+            format: 'packed'
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.equal(res.count, 1);
+            assert.deepEqual(res.attrs, [ 'dn', 'sn' ]);
+            assert(res.index instanceof Uint32Array);
+            function value(v) {
+                return res.buffer.toString('utf8', res.offsets[v], res.offsets[v + 1]);
+            }
+            assert.equal(value(res.index[0]), 'cn=Babs,dc=sample,dc=com');
+            assert.equal(res.index[2] - res.index[1], 1);
+            assert.equal(value(res.index[1]), 'Jensen');
+            done();
+        });
+    });
+    it ('Should compare true', function(done) {
+        ldap.compare('cn=Babs,dc=sample,dc=com', 'sn', 'Jensen', function(err, res) {
+            assert.ifError(err);
+            assert.strictEqual(res, true);
+            done();
+        });
+    });
+    it ('Should compare false', function(done) {
+        ldap.compare('cn=Babs,dc=sample,dc=com', 'sn', 'Smith', function(err, res) {
+            assert.ifError(err);
+            assert.strictEqual(res, false);
+            done();
+        });
+    });
+    it ('Should fail to compare a missing entry', function(done) {
+        ldap.compare('cn=Nobody,dc=sample,dc=com', 'sn', 'Smith', function(err) {
+            assert.ifError(!err);
+            done();
+        });
+    });
+    it ('Should check group membership', function(done) {
+        ldap.ismember({
+            group: 'cn=Auditors,ou=Accounting,dc=sample,dc=com',
+            members: [ 'cn=Babs,dc=sample,dc=com', 'cn=Charlie,dc=sample,dc=com' ]
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.deepEqual(res, {
+                'cn=Babs,dc=sample,dc=com': true,
+                'cn=Charlie,dc=sample,dc=com': false
+            });
+            done();
+        });
+    });
     it ('Should handle a null result', function(done) {
         ldap.search({
             base:   'dc=sample,dc=com',
@@ -216,6 +285,83 @@ describe('LDAP', function() {
             });
         }
     });
+    it ('Should not move a bind across other requests', function(done) {
+        this.timeout(5000);
+        var limited = new LDAP({
+            uri: 'ldap://localhost:1234',
+            base: 'dc=sample,dc=com',
+            maxinflight: 2
+        }, function(err) {
+            assert.ifError(err);
+            var order = [];
+            function searched(err) {
+                assert.ifError(err);
+                order.push('search');
+            }
+            for (var x = 0 ; x < 10 ; x++) {
+                limited.search({ filter: '(cn=albert)', priority: 'bulk' }, searched);
+            }
+            limited.bind({binddn: 'cn=Manager,dc=sample,dc=com', password: 'secret'}, function(err) {
+                assert.ifError(err);
+                order.push('bind');
+            });
+            limited.search({ filter: '(cn=albert)', priority: 'auth' }, function(err) {
+                assert.ifError(err);
+                order.push('after');
+                assert.equal(order.indexOf('bind'), 10);
+                assert.equal(order.indexOf('after'), 11);
+                assert(limited.inflight === 0);
+                limited.close();
+                done();
+            });
+        });
+    });
+    it ('Should send interactive searches ahead of bulk ones', function(done) {
+        this.timeout(5000);
+        var limited = new LDAP({
+            uri: 'ldap://localhost:1234',
+            base: 'dc=sample,dc=com',
+            maxinflight: 1
+        }, function(err) {
+            assert.ifError(err);
+            var order = [];
+            for (var x = 0 ; x < 10 ; x++) {
+                limited.search({
+                    filter: '(cn=albert)',
+                    priority: 'bulk'
+                }, function(err) {
+                    assert.ifError(err);
+                    order.push('bulk');
+                    if (order.length === 11) {
+                        assert(order.indexOf('interactive') < 3);
+                        limited.close();
+                        done();
+                    }
+                });
+            }
+            limited.search({ filter: '(cn=babs)' }, function(err) {
+                assert.ifError(err);
+                order.push('interactive');
+            });
+        });
+    });
+    it ('Should not shed quick requests behind slow bulk ones', function() {
+        var Scheduler = require('../LDAPScheduler');
+        var scheduler = new Scheduler(1);
+        var now = Date.now();
+        for (var x = 0 ; x < 5 ; x++) {
+            scheduler.observe({ priority: 'bulk' }, 5000);
+        }
+        scheduler.observe({ priority: 'auth' }, 10);
+        assert(scheduler.late({ priority: 'bulk', deadline: now + 2000 }, now));
+        assert(!scheduler.late({ priority: 'auth', deadline: now + 2000 }, now));
+        assert(!scheduler.late({ priority: 'interactive', deadline: now + 2000 }, now));
+    });
+    it ('Should reject an unknown priority', function() {
+        assert.throws(function() {
+            ldap.search({ priority: 'urgent' }, function() {});
+        });
+    });
     it ('Should rename', function(done) {
         ldap.rename('cn=Albert,ou=Accounting,dc=sample,dc=com', 'cn=Alberto', function(err) {
             assert.ifError(err);
@@ -311,6 +457,54 @@ describe('LDAP', function() {
     it ('Should close again', function() {
         ldap.close();
     });
+    it ('Should hold requests made while connecting', function(done) {
+        ldap = new LDAP({
+            uri: 'ldap://localhost:1234',
+            base: 'dc=sample,dc=com',
+            attrs: '*'
+        });
+        ldap.search({
+            filter: '(cn=babs)'
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.equal(res.length, 1);
+            ldap.close();
+            done();
+        });
+    });
+    it ('Should cancel a held request', function(done) {
+        ldap = new LDAP({
+            uri: 'ldap://localhost:1234',
+            base: 'dc=sample,dc=com',
+            attrs: '*'
+        }, function(err) {
+            assert.ifError(err);
+            setTimeout(function() {
+                assert.equal(ldap.stats.requests, 0);
+                ldap.close();
+                done();
+            }, 100);
+        });
+        ldap.search({
+            filter: '(cn=babs)'
+        }, function() {
+            assert(false, 'cancelled request was answered');
+        });
+        ldap.lastrequest.cancel();
+    });
+    it ('Should not block while connecting to a dead server', function(done) {
+        this.timeout(5000);
+        var started = Date.now();
+        var dead = new LDAP({
+            uri: 'ldap://192.0.2.1',
+            ntimeout: 1000
+        }, function(err) {
+            assert.ifError(!err);
+            dead.close();
+            done();
+        });
+        assert(Date.now() - started < 100);
+    });
     it ('Should connect over domain socket', function(done) {
         ldap = new LDAP({
             uri: 'ldapi://%2ftmp%2fslapd.sock',
@@ -30,7 +30,7 @@ describe('Issues', function() {
             filter: '(objectClass=*)'
         }, function(err, res) {
             assert.ifError(err);
-            assert.equal(res.length, 6);
+            assert.equal(res.length, 7);
             done();
         });
 
@@ -67,7 +67,7 @@ describe('Issues', function() {
                 filter: '(objectClass=*)'
             }, function(err, res) {
                 assert.ifError(err);
-                assert.equal(res.length, 6, 'Unexpected number of results');
+                assert.equal(res.length, 7, 'Unexpected number of results');
                 ldap.search({
                 base: 'dc=sample,dc=com',
                 scope: LDAP.ONELEVEL,
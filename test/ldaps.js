@@ -67,5 +67,47 @@ describe('LDAP TLS', function() {
     });    
     it ('Should still have TLS', function() {
         assert(ldap.tlsactive());
+        ldap.close();
+    });
+    it ('Should share a TLS context between connections', function(done) {
+        this.timeout(10000);
+        var opt = {
+            uri: 'ldaps://localhost:1235',
+            base: 'dc=sample,dc=com',
+            attrs: '*',
+            validatecert: false,
+            sharetls: true
+        };
+        ldap = new LDAP(opt, function(err) {
+            assert.ifError(err);
+            var ldap2 = new LDAP(opt, function(err) {
+                assert.ifError(err);
+                ldap2.search({
+                    filter: '(cn=babs)'
+                }, function(err, res) {
+                    assert.ifError(err);
+                    assert.equal(res.length, 1);
+                    assert(ldap2.tlsactive());
+                    // the first connection's session was resumed, where
+                    // libldap's TLS library allows for it
+                    assert.equal(ldap.stats.tlsresumes, 0);
+                    assert.equal(ldap2.stats.tlsresumes,
+                                 ldap2.tlsresumable() ? 1 : 0);
+                    ldap2.close();
+                    done();
+                });
+            });
+        });
+    });
+    it ('Should search over the shared context', function(done) {
+        ldap.search({
+            filter: '(cn=babs)'
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.equal(res.length, 1);
+            assert(ldap.tlsactive());
+            ldap.close();
+            done();
+        });
     });
 });
@@ -0,0 +1,104 @@
+/*jshint globalstrict:true, node:true, trailing:true, mocha:true unused:true */
+
+'use strict';
+
+var LDAP = require('../');
+var assert = require('assert');
+var ldap;
+
+describe('LDAP referrals', function() {
+    it ('Should connect', function(done) {
+        ldap = new LDAP({
+            uri: 'ldap://localhost:1234',
+            base: 'dc=sample,dc=com',
+            attrs: '*',
+            referrals: 1
+        }, done);
+    });
+    it ('Should bind', function(done) {
+        ldap.bind({binddn: 'cn=Manager,dc=sample,dc=com', password: 'secret'}, function(err) {
+            assert.ifError(err);
+            done();
+        });
+    });
+    it ('Should chase a search reference', function(done) {
+        ldap.search({
+            filter: '(cn=albert)',
+            scope:  LDAP.SUBTREE
+        }, function(err, res) {
+            assert.ifError(err);
+            // once directly, once through ou=Branch
+            assert.equal(res.length, 2);
+            assert.equal(res[0].dn, 'cn=Albert,ou=Accounting,dc=sample,dc=com');
+            assert.equal(res[1].dn, 'cn=Albert,ou=Accounting,dc=sample,dc=com');
+            assert.equal(ldap.stats.referrals, 1);
+            done();
+        });
+    });
+    it ('Should reuse the referral connection', function(done) {
+        ldap.search({
+            filter: '(cn=albert)',
+            scope:  LDAP.SUBTREE
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.equal(res.length, 2);
+            assert.equal(ldap.referralcache.order.length, 1);
+            done();
+        });
+    });
+    it ('Should not send credentials to an untrusted referral', function() {
+        var uri = ldap.referralcache.order[0];
+        assert.equal(ldap.referralcache.get(uri).ldap.credentials, undefined);
+        assert(!ldap.trusts('ldap://localhost:1234'));
+        ldap.options.referralhosts = [ 'localhost' ];
+        assert(!ldap.trusts('ldap://localhost:1234'));
+        assert(ldap.trusts('ldaps://localhost:1235'));
+        ldap.options.referralhosts = [];
+    });
+    it ('Should keep the search scope when a referral has none', function(done) {
+        // the whole search is referred, with a URL that carries no scope
+        ldap.search({
+            base:   'ou=Branch,dc=sample,dc=com',
+            filter: '(cn=albert)',
+            scope:  LDAP.SUBTREE
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.equal(res.length, 1);
+            assert.equal(res[0].dn, 'cn=Albert,ou=Accounting,dc=sample,dc=com');
+            done();
+        });
+    });
+    it ('Should chase as objects whatever the default format', function(done) {
+        var columns = new LDAP({
+            uri: 'ldap://localhost:1234',
+            base: 'dc=sample,dc=com',
+            format: 'columns',
+            referrals: 1
+        }, function(err) {
+            assert.ifError(err);
+            columns.search({
+                filter: '(cn=albert)',
+                scope:  LDAP.SUBTREE,
+                format: 'object'
+            }, function(err, res) {
+                assert.ifError(err);
+                assert.equal(res.length, 2);
+                assert.equal(res[1].dn, 'cn=Albert,ou=Accounting,dc=sample,dc=com');
+                columns.close();
+                done();
+            });
+        });
+    });
+    it ('Should not chase past the hop limit', function(done) {
+        ldap.search({
+            filter: '(cn=albert)',
+            scope:  LDAP.SUBTREE,
+            referralhops: 0
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.equal(res.length, 1);
+            ldap.close();
+            done();
+        });
+    });
+});
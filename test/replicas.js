@@ -0,0 +1,88 @@
+/*jshint globalstrict:true, node:true, trailing:true, mocha:true unused:true */
+
+'use strict';
+
+var LDAP = require('../');
+var assert = require('assert');
+var ldap;
+
+describe('LDAP replica set', function() {
+    it ('Should connect', function(done) {
+        ldap = new LDAP.ReplicaSet({
+            uri: [ 'ldap://localhost:1234', 'ldapi://%2ftmp%2fslapd.sock' ],
+            base: 'dc=sample,dc=com',
+            attrs: '*',
+            hedge: true,
+            hedgedelay: 0
+        }, done);
+    });
+    it ('Should bind all replicas', function(done) {
+        ldap.bind({binddn: 'cn=Manager,dc=sample,dc=com', password: 'secret'}, function(err) {
+            assert.ifError(err);
+            done();
+        });
+    });
+    it ('Should search the fastest replica', function(done) {
+        ldap.search({
+            filter: '(cn=babs)',
+            scope:  LDAP.SUBTREE
+        }, function(err, res) {
+            assert.ifError(err);
+            assert.equal(res.length, 1);
+            assert.equal(res[0].dn, 'cn=Babs,dc=sample,dc=com');
+            done();
+        });
+    });
+    it ('Should hedge slow searches and drop the losers', function(done) {
+        this.timeout(5000);
+        var count = 0;
+        var answered = {};
+        // claim every replica is instant, so any real search is "slow"
+        ldap.replicas.forEach(function(replica) {
+            replica.samples = [ 0 ];
+        });
+        for (var x = 0 ; x < 200 ; x++) {
+            ldap.search({
+                filter: '(cn=albert)'
+            }, function(x, err, res) {
+                assert.ifError(err);
+                assert.equal(res.length, 1);
+                assert(!answered[x], 'search answered twice');
+                answered[x] = true;
+                if (++count === 200) {
+                    // give abandoned losers time to come back, if they will
+                    setTimeout(check, 200);
+                }
+            }.bind(null, x));
+        }
+        function check() {
+            var hedges = 0, late = 0;
+            ldap.replicas.forEach(function(replica) {
+                hedges += replica.hedges;
+                late += replica.ldap.stats.lateresponses;
+            });
+            assert.equal(count, 200);
+            assert(hedges > 0, 'nothing was hedged');
+            // only a loser that was already on the wire can answer late
+            assert(late <= hedges);
+            ldap.close();
+            done();
+        }
+    });
+    it ('Should stop reading from a replica that failed a bind', function(done) {
+        this.timeout(5000);
+        var set = new LDAP.ReplicaSet({
+            uri: [ 'ldap://localhost:1234', 'ldap://192.0.2.1' ],
+            base: 'dc=sample,dc=com',
+            ntimeout: 200,
+            timeout: 1000
+        });
+        set.bind({binddn: 'cn=Manager,dc=sample,dc=com', password: 'secret'}, function(err) {
+            assert.ifError(err);
+            assert(set.replicas[1].unbound);
+            assert.deepEqual(set.ranked(), [ set.replicas[0] ]);
+            set.close();
+            done();
+        });
+    });
+});
@@ -21,7 +21,6 @@ describe('LDAP TLS', function() {
             ldap.starttls(function(err) {
                 console.log('ERR', err);
                 assert.ifError(err);
-                ldap.installtls();
                 assert(ldap.tlsactive() == 1);
                 done();
             });
@@ -38,7 +37,7 @@ describe('LDAP TLS', function() {
             assert.ifError(err);
             ldap.starttls(function(err) {
                 assert.ifError(err);
-                ldap.installtls();
+                // starttls() has already installed TLS
                 assert(ldap.tlsactive());
                 done();
             });
@@ -82,4 +81,29 @@ describe('LDAP TLS', function() {
         assert(ldap.tlsactive());
         ldap.close();
     });
+    it ('Should fail held requests when the handshake fails', function(done) {
+        this.timeout(10000);
+        ldap = new LDAP({
+            uri: 'ldap://localhost:1234',
+            base: 'dc=sample,dc=com',
+            attrs: '*'
+        }, function(err) {
+            var failed = false;
+            assert.ifError(err);
+            // no StartTLS first, so the server can't complete a handshake
+            ldap.installtls(function(err) {
+                assert(err);
+                assert(failed);
+                assert.equal(ldap.ld, undefined);
+                done();
+            });
+            ldap.search({
+                filter: '(cn=babs)'
+            }, function(err) {
+                assert(err);
+                assert.equal(ldap.stats.requests, 0);
+                failed = true;
+            });
+        });
+    });
 });